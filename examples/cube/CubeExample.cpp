@@ -48,6 +48,8 @@ public:
                 break;
             case Success:
                 break;
+            default:
+                break;
         }
     }
 };
@@ -52,6 +52,8 @@ protected:
                 break;
             case Success:
                 break;
+            default:
+                break;
         }
     }
 
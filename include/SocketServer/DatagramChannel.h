@@ -0,0 +1,458 @@
+#pragma once
+
+#include <SocketServer/common.h>
+#include <SocketServer/mpscqueue.h>
+#include <SocketServer/handlermemory.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+using asio::ip::udp;
+
+/**
+ * A message received over a DatagramChannel along with who sent it
+ */
+template <typename T>
+struct DatagramMessage
+{
+    udp::endpoint sender;
+    uint64_t sequence = 0;
+    Message<T> message;
+};
+
+/**
+ * Lossy datagram channel for updates that are stale within milliseconds
+ *
+ * Every message travels in its own UDP datagram, unicast or to a multicast group, next to the
+ * TCP connection that stays the control channel. Senders number their datagrams and receivers
+ * keep the newest sequence they delivered per sender and message id, so a late or duplicated
+ * update is dropped instead of overwriting a newer one. Senders that go quiet for longer than the
+ * sender timeout are forgotten. Sends made while the socket is busy are
+ * batched into a single sendmmsg on Linux.
+ *
+ * With a group key set, datagrams are sealed with AES-256-GCM. DTLS can't protect multicast as
+ * it needs a session per peer, so the key is shared by the group and handed out over the TLS
+ * control channel instead. The 64 bit random sender id and the 32 bit sequence form the nonce,
+ * a sender picks a new id before its sequence wraps so no nonce repeats under the group key.
+ * Replays are only caught while the sender is remembered, see ForgetStaleSenders.
+ */
+template <typename T>
+class DatagramChannel {
+public:
+    // Keeps datagrams below a typical Ethernet MTU so they are never fragmented
+    static constexpr size_t DEFAULT_MAX_DATAGRAM_SIZE = 1472;
+
+    // A sender that restarts picks a new id, so the old one's sequences are never needed again
+    static constexpr std::chrono::seconds DEFAULT_SENDER_TIMEOUT { 30 };
+
+    struct stats {
+        uint64_t sent = 0;
+        uint64_t received = 0;
+        // Older than or equal to what was already delivered for the same sender and id
+        uint64_t stale = 0;
+        // Truncated, unauthenticated or otherwise unreadable datagrams
+        uint64_t rejected = 0;
+        // Dropped on send because the socket buffer was full
+        uint64_t dropped = 0;
+        // Dropped on receive because nobody drained the incoming queue in time
+        uint64_t overflowed = 0;
+        uint64_t batches = 0;
+    };
+
+protected:
+    // Sender id, sequence number, then the message header and body
+    static constexpr size_t PREFIX_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+    static constexpr size_t IV_SIZE = 12;
+    static constexpr size_t TAG_SIZE = 16;
+    // The prefix is the nonce, it travels in the clear and costs nothing on top
+    static_assert(PREFIX_SIZE == IV_SIZE, "The datagram prefix must be a GCM nonce");
+
+    asio::io_context io_context;
+    std::thread thread_context;
+    udp::socket socket { io_context };
+
+    // Recycled storage for the send and receive handlers
+    handler_memory handlerMemory;
+
+    udp::endpoint destination;
+    size_t nMaxDatagramSize = DEFAULT_MAX_DATAGRAM_SIZE;
+
+    // Random per channel so receivers can tell a restarted sender from a replay
+    uint64_t senderId = 0;
+    uint32_t nSequence = 0;
+
+    // Newest sequence delivered per message id of a sender, and when the sender was last heard from
+    struct sender {
+        std::unordered_map<uint32_t, uint32_t> lastSequence;
+        std::chrono::steady_clock::time_point seen;
+    };
+    std::unordered_map<uint64_t, sender> senders;
+    std::chrono::steady_clock::duration senderTimeout = DEFAULT_SENDER_TIMEOUT;
+    std::chrono::steady_clock::time_point lastSweep;
+
+    // Receive errors other than a closed socket retry after a delay that doubles up to a second
+    asio::steady_timer retryTimer { io_context };
+    std::chrono::milliseconds retryDelay { 0 };
+
+    // Encoded datagrams waiting for the next batched send, only touched from the io thread
+    std::vector<std::vector<uint8_t>> vecBatch;
+    std::vector<udp::endpoint> vecBatchDestinations;
+    bool bFlushPending = false;
+
+    std::vector<uint8_t> vecReceiveBuffer;
+    udp::endpoint receiveEndpoint;
+
+    std::vector<uint8_t> groupKey;
+    EVP_CIPHER_CTX* cipher = nullptr;
+
+    mpscqueue<DatagramMessage<T>> qMessagesIn;
+
+    std::atomic<uint64_t> nSent { 0 };
+    std::atomic<uint64_t> nReceived { 0 };
+    std::atomic<uint64_t> nStale { 0 };
+    std::atomic<uint64_t> nRejected { 0 };
+    std::atomic<uint64_t> nDropped { 0 };
+    std::atomic<uint64_t> nOverflowed { 0 };
+    std::atomic<uint64_t> nBatches { 0 };
+
+public:
+    DatagramChannel()
+        : vecReceiveBuffer(64 * 1024)
+    {
+        RAND_bytes(reinterpret_cast<unsigned char*>(&this->senderId), sizeof(this->senderId));
+        this->cipher = EVP_CIPHER_CTX_new();
+    }
+
+    virtual ~DatagramChannel() {
+        this->Stop();
+        EVP_CIPHER_CTX_free(this->cipher);
+    }
+
+public:
+    // Binds to local to receive, use port 0 for a channel that only sends
+    // reuse lets several receivers on one host share a multicast port
+    void Open(const udp::endpoint& local, bool reuse = true) {
+        this->socket.open(local.protocol());
+        this->socket.set_option(udp::socket::reuse_address(reuse));
+        this->socket.bind(local);
+        this->socket.native_non_blocking(true);
+
+        // Bursts of updates arrive faster than one thread drains them, the kernel caps this at rmem_max
+        std::error_code err;
+        this->socket.set_option(asio::socket_base::receive_buffer_size(4 * 1024 * 1024), err);
+        this->socket.set_option(asio::socket_base::send_buffer_size(1024 * 1024), err);
+    }
+
+    // Receive everything sent to group on this host's default interface
+    void JoinGroup(const asio::ip::address& group) {
+        this->socket.set_option(asio::ip::multicast::join_group(group));
+    }
+
+    // Where Send() goes, a multicast group or a single peer
+    // ttl limits how many routers multicast datagrams may cross, 1 keeps them on the LAN
+    void SetDestination(const udp::endpoint& destination, int ttl = 1) {
+        this->destination = destination;
+        if (destination.address().is_multicast()) {
+            this->socket.set_option(asio::ip::multicast::hops(ttl));
+        }
+    }
+
+    // Messages larger than this after framing are refused, they belong on the control channel
+    void SetMaxDatagramSize(size_t bytes) {
+        this->nMaxDatagramSize = bytes;
+    }
+
+    // Seals every datagram with AES-256-GCM under key (32 bytes), an empty key turns it off
+    // Must be called before Start(), every member of the group needs the same key
+    void SetGroupKey(const std::vector<uint8_t>& key) {
+        if (!key.empty() && key.size() != 32) {
+            throw std::invalid_argument("The group key must be 32 bytes");
+        }
+        this->groupKey = key;
+    }
+
+    // Sequences of senders not heard from within timeout are forgotten, must be called before Start()
+    void SetSenderTimeout(std::chrono::steady_clock::duration timeout) {
+        this->senderTimeout = timeout;
+    }
+
+    // Runs the channel on its own thread
+    void Start() {
+        this->Receive();
+        this->thread_context = std::thread([this]() { this->io_context.run(); });
+    }
+
+    void Stop() {
+        this->io_context.stop();
+        if (this->thread_context.joinable()) this->thread_context.join();
+
+        std::error_code err;
+        this->socket.close(err);
+    }
+
+    // ASYNC - Send msg to the destination, returns false if it doesn't fit in a datagram
+    bool Send(const Message<T>& msg) {
+        return this->SendTo(msg, this->destination);
+    }
+
+    // ASYNC - Send msg to to, returns false if it doesn't fit in a datagram
+    bool SendTo(const Message<T>& msg, const udp::endpoint& to) {
+        size_t overhead = PREFIX_SIZE + sizeof(MessageHeader<T>) + (this->groupKey.empty() ? 0 : TAG_SIZE);
+        if (overhead + msg.body.size() > this->nMaxDatagramSize) {
+            return false;
+        }
+
+        asio::post(this->io_context, make_custom_alloc_handler(this->handlerMemory,
+            [this, msg = msg, to]() {
+                this->vecBatch.push_back(this->Encode(msg));
+                this->vecBatchDestinations.push_back(to);
+
+                // Everything sent before the flush runs leaves in the same batch
+                if (!this->bFlushPending) {
+                    this->bFlushPending = true;
+                    asio::post(this->io_context, make_custom_alloc_handler(this->handlerMemory, [this]() { this->Flush(); }));
+                }
+            }
+        ));
+        return true;
+    }
+
+    mpscqueue<DatagramMessage<T>>& IncomingMessages() {
+        return this->qMessagesIn;
+    }
+
+    stats Stats() const {
+        stats current;
+        current.sent = this->nSent.load(std::memory_order_relaxed);
+        current.received = this->nReceived.load(std::memory_order_relaxed);
+        current.stale = this->nStale.load(std::memory_order_relaxed);
+        current.rejected = this->nRejected.load(std::memory_order_relaxed);
+        current.dropped = this->nDropped.load(std::memory_order_relaxed);
+        current.overflowed = this->nOverflowed.load(std::memory_order_relaxed);
+        current.batches = this->nBatches.load(std::memory_order_relaxed);
+        return current;
+    }
+
+private:
+    std::vector<uint8_t> Encode(const Message<T>& msg) {
+        // Going on as a new sender keeps the nonces unique, receivers treat it like a restart
+        if (this->nSequence == UINT32_MAX) {
+            RAND_bytes(reinterpret_cast<unsigned char*>(&this->senderId), sizeof(this->senderId));
+            this->nSequence = 0;
+        }
+        uint32_t sequence = ++this->nSequence;
+
+        std::vector<uint8_t> datagram(PREFIX_SIZE);
+        std::memcpy(datagram.data(), &this->senderId, sizeof(uint64_t));
+        std::memcpy(datagram.data() + sizeof(uint64_t), &sequence, sizeof(uint32_t));
+
+        MessageHeader<T> header = msg.header;
+        header.size = (uint32_t)msg.body.size();
+
+        if (this->groupKey.empty()) {
+            const uint8_t* pHeader = reinterpret_cast<const uint8_t*>(&header);
+            datagram.insert(datagram.end(), pHeader, pHeader + sizeof(MessageHeader<T>));
+            datagram.insert(datagram.end(), msg.body.data(), msg.body.data() + msg.body.size());
+            return datagram;
+        }
+
+        std::vector<uint8_t> plain(sizeof(MessageHeader<T>) + msg.body.size());
+        std::memcpy(plain.data(), &header, sizeof(MessageHeader<T>));
+        if (msg.body.size() > 0) {
+            std::memcpy(plain.data() + sizeof(MessageHeader<T>), msg.body.data(), msg.body.size());
+        }
+
+        // The sender id and sequence are unique per datagram, which is all GCM asks of its IV
+        datagram.resize(PREFIX_SIZE + plain.size() + TAG_SIZE);
+        int length = 0;
+        EVP_EncryptInit_ex(this->cipher, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+        EVP_CIPHER_CTX_ctrl(this->cipher, EVP_CTRL_GCM_SET_IVLEN, IV_SIZE, nullptr);
+        EVP_EncryptInit_ex(this->cipher, nullptr, nullptr, this->groupKey.data(), datagram.data());
+        EVP_EncryptUpdate(this->cipher, nullptr, &length, datagram.data(), PREFIX_SIZE);
+        EVP_EncryptUpdate(this->cipher, datagram.data() + PREFIX_SIZE, &length, plain.data(), (int)plain.size());
+        EVP_EncryptFinal_ex(this->cipher, datagram.data() + PREFIX_SIZE + length, &length);
+        EVP_CIPHER_CTX_ctrl(this->cipher, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, datagram.data() + PREFIX_SIZE + plain.size());
+        return datagram;
+    }
+
+    // Hands every batched datagram to the kernel, with as few system calls as the platform allows
+    void Flush() {
+        this->bFlushPending = false;
+        size_t count = this->vecBatch.size();
+        size_t sent = 0;
+
+#if defined(__linux__)
+        std::vector<mmsghdr> headers(count);
+        std::vector<iovec> iovecs(count);
+        for (size_t i = 0; i < count; i++) {
+            iovecs[i].iov_base = this->vecBatch[i].data();
+            iovecs[i].iov_len = this->vecBatch[i].size();
+
+            std::memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_name = this->vecBatchDestinations[i].data();
+            headers[i].msg_hdr.msg_namelen = (socklen_t)this->vecBatchDestinations[i].size();
+            headers[i].msg_hdr.msg_iov = &iovecs[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        while (sent < count) {
+            int result = ::sendmmsg(this->socket.native_handle(), headers.data() + sent, (unsigned int)(count - sent), 0);
+            if (result <= 0) {
+                break;
+            }
+            sent += result;
+            this->nBatches.fetch_add(1, std::memory_order_relaxed);
+        }
+#else
+        for (; sent < count; sent++) {
+            std::error_code err;
+            this->socket.send_to(asio::buffer(this->vecBatch[sent]), this->vecBatchDestinations[sent], 0, err);
+            if (err) {
+                break;
+            }
+        }
+        this->nBatches.fetch_add(1, std::memory_order_relaxed);
+#endif
+
+        // Whatever the kernel had no room for is stale by the next flush anyway
+        this->nSent.fetch_add(sent, std::memory_order_relaxed);
+        this->nDropped.fetch_add(count - sent, std::memory_order_relaxed);
+        this->vecBatch.clear();
+        this->vecBatchDestinations.clear();
+    }
+
+    // ASYNC - Prime context to receive the next datagram
+    void Receive() {
+        this->socket.async_receive_from(asio::buffer(this->vecReceiveBuffer), this->receiveEndpoint, make_custom_alloc_handler(this->handlerMemory,
+            [this](std::error_code err, std::size_t length) {
+                if (err == asio::error::operation_aborted) {
+                    return;
+                }
+
+                if (!err) {
+                    this->retryDelay = std::chrono::milliseconds(0);
+                    this->Decode(length);
+                    this->Receive();
+                    return;
+                }
+
+                // A closed socket fails every receive from now on
+                if (err == asio::error::bad_descriptor || !this->socket.is_open()) {
+                    LOG(ERROR, "Datagram socket closed -- receiving stopped", err.message());
+                    return;
+                }
+
+                LOG(ERROR, "Datagram receive error", err.message());
+                this->RetryReceive();
+            }
+        ));
+    }
+
+    // Waits before the next receive, so an error that keeps coming back doesn't spin the io thread
+    void RetryReceive() {
+        this->retryDelay = std::clamp(this->retryDelay * 2, std::chrono::milliseconds(1), std::chrono::milliseconds(1000));
+        this->retryTimer.expires_after(this->retryDelay);
+        this->retryTimer.async_wait([this](std::error_code err) {
+            if (!err) {
+                this->Receive();
+            }
+        });
+    }
+
+    // Drops the senders that have been quiet for longer than the timeout, at most once per timeout
+    // A forgotten sender's old datagrams are accepted again if someone replays them, the group key only proves
+    // they came from a member. Keep the timeout above how long a replayed update could still do harm
+    void ForgetStaleSenders(std::chrono::steady_clock::time_point now) {
+        if (now - this->lastSweep < this->senderTimeout) {
+            return;
+        }
+        this->lastSweep = now;
+
+        for (auto it = this->senders.begin(); it != this->senders.end();) {
+            if (now - it->second.seen > this->senderTimeout) {
+                it = this->senders.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    void Decode(size_t length) {
+        size_t overhead = PREFIX_SIZE + sizeof(MessageHeader<T>) + (this->groupKey.empty() ? 0 : TAG_SIZE);
+        if (length < overhead) {
+            this->nRejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        uint8_t* datagram = this->vecReceiveBuffer.data();
+        uint64_t senderId;
+        uint32_t sequence;
+        std::memcpy(&senderId, datagram, sizeof(uint64_t));
+        std::memcpy(&sequence, datagram + sizeof(uint64_t), sizeof(uint32_t));
+
+        uint8_t* payload = datagram + PREFIX_SIZE;
+        size_t payloadSize = length - PREFIX_SIZE;
+
+        if (!this->groupKey.empty()) {
+            payloadSize -= TAG_SIZE;
+            int plainLength = 0;
+            int finalLength = 0;
+            EVP_DecryptInit_ex(this->cipher, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+            EVP_CIPHER_CTX_ctrl(this->cipher, EVP_CTRL_GCM_SET_IVLEN, IV_SIZE, nullptr);
+            EVP_DecryptInit_ex(this->cipher, nullptr, nullptr, this->groupKey.data(), datagram);
+            EVP_DecryptUpdate(this->cipher, nullptr, &plainLength, datagram, PREFIX_SIZE);
+            EVP_DecryptUpdate(this->cipher, payload, &plainLength, payload, (int)payloadSize);
+            EVP_CIPHER_CTX_ctrl(this->cipher, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, payload + payloadSize);
+            if (EVP_DecryptFinal_ex(this->cipher, payload + plainLength, &finalLength) <= 0) {
+                this->nRejected.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        DatagramMessage<T> incoming;
+        std::memcpy(&incoming.message.header, payload, sizeof(MessageHeader<T>));
+        if (incoming.message.header.size != payloadSize - sizeof(MessageHeader<T>)) {
+            this->nRejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // Only the newest update per sender and message id is worth delivering
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        this->ForgetStaleSenders(now);
+        sender& from = this->senders[senderId];
+        uint32_t id = (uint32_t)incoming.message.header.id;
+        auto last = from.lastSequence.find(id);
+        if (last != from.lastSequence.end() && sequence <= last->second) {
+            this->nStale.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        from.lastSequence[id] = sequence;
+        from.seen = now;
+
+        const uint8_t* body = payload + sizeof(MessageHeader<T>);
+        incoming.message.body.assign(body, body + incoming.message.header.size);
+        incoming.sender = this->receiveEndpoint;
+        incoming.sequence = sequence;
+
+        // Blocking the io thread would only make the kernel drop the next datagrams instead
+        if (!this->qMessagesIn.try_push(std::move(incoming))) {
+            this->nOverflowed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        this->nReceived.fetch_add(1, std::memory_order_relaxed);
+    }
+};
@@ -1,46 +1,71 @@
 #pragma once
 
 #include <SocketServer/common.h>
-#include <SocketServer/tsqueue.h>
+#include <SocketServer/mpscqueue.h>
+#include <SocketServer/handlermemory.h>
 #include <SocketServer/SocketConnection.h>
+#include <SocketServer/tlsresumption.h>
 #include <thread>
+#include <type_traits>
 
 using asio::ip::tcp;
 
-template<typename T>
+// Transport picks how the client reaches the server, see transport.h
+template<typename T, typename Transport = tls_transport>
 class SocketClient {
 protected:
     asio::io_context io_context;
     std::thread thread_context;
     std::thread message_thread;
         
-    std::unique_ptr<SocketConnection<T>> m_connection;
+    std::unique_ptr<SocketConnection<T, Transport>> m_connection;
 
 private:
-    tsqueue<OwnedMessage<T>> qMessagesIn;
+    mpscqueue<OwnedMessage<T, Transport>> qMessagesIn;
 
     std::string host;
     uint16_t port;
 
+    // Used instead of host and port when there is no host to resolve
+    typename Transport::endpoint_type endpoint;
 
     std::string certPath;
     std::string keyPath;
     std::string caPath;
 
     ClientType clientType;
-    asio::ssl::context ssl_context;
+    typename Transport::context_type transportContext;
+
+    // Announced to the server in the hello
+    uint64_t deviceId = 0;
+    uint32_t capabilities = 0;
+
+    // Keeps the last session so a reconnect can resume it
+    std::unique_ptr<tlsresumption> tlsResumption;
 
     asio::steady_timer m_timer { this->io_context, asio::chrono::seconds(2) };
     asio::steady_timer pulse_timer { this->io_context, asio::chrono::seconds(10) };
 
     uint8_t errorCount = 0;
 
+    // Recycled storage for the timer handlers, connection handlers use the connection's own
+    handler_memory handlerMemory;
+
+    InboundLimits inboundLimits;
+
 public:
     SocketClient(const std::string& host, const uint16_t port, std::string certPath, std::string keyPath, std::string caPath, ClientType type)
-        : host(host), port(port), certPath(certPath), keyPath(keyPath), caPath(caPath), clientType(type), ssl_context(asio::ssl::context::sslv23)
+        : host(host), port(port), certPath(certPath), keyPath(keyPath), caPath(caPath), clientType(type), transportContext(Transport::make_context())
     {
         this->Initialize();
     };
+
+    // Connect without TLS to endpoint, an address and port for tcp_transport or a path for local_transport and shm_transport
+    SocketClient(const typename Transport::endpoint_type& endpoint, ClientType type)
+        : port(0), endpoint(endpoint), clientType(type), transportContext(Transport::make_context())
+    {
+        static_assert(!Transport::secure, "A TLS client needs its certificate, key and CA");
+    }
     
     virtual ~SocketClient() {
         this->Disconnect();
@@ -49,16 +74,20 @@ public:
 public:
 
     void Initialize() {
-            this->ssl_context.set_options(
+        if constexpr (Transport::secure) {
+            this->transportContext.set_options(
                 asio::ssl::context::default_workarounds 
                 | asio::ssl::context::no_sslv2
                 | asio::ssl::context::single_dh_use);
 
-            this->ssl_context.set_verify_mode(asio::ssl::verify_peer | asio::ssl::verify_fail_if_no_peer_cert);
-            this->ssl_context.load_verify_file(this->caPath);
+            this->transportContext.set_verify_mode(asio::ssl::verify_peer | asio::ssl::verify_fail_if_no_peer_cert);
+            this->transportContext.load_verify_file(this->caPath);
 
-            this->ssl_context.use_certificate_file(this->certPath, asio::ssl::context::pem);
-            this->ssl_context.use_private_key_file(this->keyPath, asio::ssl::context::pem);
+            this->transportContext.use_certificate_file(this->certPath, asio::ssl::context::pem);
+            this->transportContext.use_private_key_file(this->keyPath, asio::ssl::context::pem);
+
+            this->tlsResumption = std::make_unique<tlsresumption>(this->transportContext, false);
+        }
     }
 
     // Connect to the server
@@ -73,48 +102,46 @@ public:
 
     void AttemptConnection() {
         try {
-			tcp::resolver resolver(this->io_context);
-			tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
+            this->m_connection = std::make_unique<SocketConnection<T, Transport>>(SocketConnection<T, Transport>::owner::client, this->io_context, this->transportContext, this->qMessagesIn);           
+            this->m_connection->SetInboundLimits(this->inboundLimits);
 
-            this->m_connection = std::make_unique<SocketConnection<T>>(SocketConnection<T>::owner::client, this->io_context, ssl_context, this->qMessagesIn);           
+            if constexpr (std::is_same<typename Transport::protocol_type, asio::ip::tcp>::value) {
+                if (!this->host.empty()) {
+                    tcp::resolver resolver(this->io_context);
+                    tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
-            this->ConnectToServer(endpoints);
+                    this->ConnectToServer(endpoints);
+                    return;
+                }
+            }
+
+            this->ConnectToServer(this->endpoint);
         } catch (std::exception& e) {
             LOG(ERROR, "Exception", e.what());
         }
     }
 
     void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints) {
-        asio::async_connect(this->m_connection->socket(), endpoints,
-            [this, endpoints](std::error_code err, asio::ip::tcp::endpoint endpoint) {
+        asio::async_connect(this->m_connection->socket(), endpoints, this->m_connection->Recycled(
+            [this](std::error_code err, asio::ip::tcp::endpoint endpoint) {
                 if (!err) {
-                    this->m_connection->ssl_socket_stream().async_handshake(asio::ssl::stream_base::client,
-                        [this](std::error_code hErr) {
-                            LOG(INFO, "Connected to server");
-                            if (!hErr) {
-
-                                if (this->clientType == CUBE) {
-                                    LOG(INFO, "Initializing heartbeat");
-                                    this->Pulse();
-                                }
-
-                                this->m_connection->ReadHeaderFromServer(
-                                    [this](std::runtime_error rErr) {
-                                        LOG(ERROR, "Connection Error", rErr.what());
-                                        LOG(INFO, "Initiating autoconnect");
-                                        this->Reconnect();
-                                    }
-                                );
-                            } else {
-                                LOG(ERROR, "Handshake Error", hErr.message());
-                                this->Reconnect();
-                            }
-                        }
-                    );
+                    this->Handshake();
                 } else {
                     this->Reconnect();
                 }
-            }
+            })
+        );
+    }
+
+    void ConnectToServer(const typename Transport::endpoint_type& endpoint) {
+        this->m_connection->socket().async_connect(endpoint, this->m_connection->Recycled(
+            [this](std::error_code err) {
+                if (!err) {
+                    this->Handshake();
+                } else {
+                    this->Reconnect();
+                }
+            })
         );
     }
 
@@ -124,19 +151,19 @@ public:
         this->pulse_timer.cancel();
 
         this->m_timer.expires_from_now(asio::chrono::seconds(5));
-        this->m_timer.async_wait([this](const std::error_code& err) {
+        this->m_timer.async_wait(make_custom_alloc_handler(this->handlerMemory, [this](const std::error_code& err) {
             if (!err) {
                 this->AttemptConnection();
             } else {
                 LOG(ERROR, "Reconnection error", err.message());
             }
-        });
+        }));
     }
 
     void Pulse() {
         if (this->IsConnected()) {
             this->pulse_timer.expires_from_now(asio::chrono::seconds(10));
-            this->pulse_timer.async_wait([this](const std::error_code& err) {
+            this->pulse_timer.async_wait(make_custom_alloc_handler(this->handlerMemory, [this](const std::error_code& err) {
                 if (!err) {
                     LOG(DEBUG, "Sending pulse check");
                     Message<MessageType> message;
@@ -146,7 +173,7 @@ public:
                 } else {
                     LOG(ERROR, "Heartbeat error:", err.message());
                 }
-            });
+            }));
         }
     }
 
@@ -177,20 +204,18 @@ public:
         this->message_thread = std::thread([this]() {
             while (true) {
                 this->qMessagesIn.wait();
-                while (!this->qMessagesIn.empty()) {
-                    auto ownedMessage = this->qMessagesIn.pop_front();
-                    this->OnMessageRecieved(ownedMessage.message);
-                }
+                this->qMessagesIn.drain([this](OwnedMessage<T, Transport>& ownedMessage) {
+                    this->Dispatch(ownedMessage);
+                });
             }
         });
     }
 
     void HandleMessagesNoThread() {
         this->qMessagesIn.wait();
-        while (!this->qMessagesIn.empty()) {
-            auto ownedMessage = this->qMessagesIn.pop_front();
-            this->OnMessageRecieved(ownedMessage.message);
-        }
+        this->qMessagesIn.drain([this](OwnedMessage<T, Transport>& ownedMessage) {
+            this->Dispatch(ownedMessage);
+        });
     }
 
     void Send(const Message<T>msg) {
@@ -199,12 +224,98 @@ public:
         }
     }
 
-    tsqueue<OwnedMessage<T>>& IncomingMessages() {
+    // Frame limits for the connection, applied from the next connection attempt on
+    void SetInboundLimits(const InboundLimits& limits) {
+        this->inboundLimits = limits;
+    }
+
+    // Identifies this device to the server, sent in the hello of the next connection
+    void SetDeviceId(uint64_t deviceId) {
+        this->deviceId = deviceId;
+    }
+
+    // Wire features this client supports, sent in the hello of the next connection
+    void SetCapabilities(uint32_t capabilities) {
+        this->capabilities = capabilities;
+    }
+
+    // Wire features both sides support, 0 until the server answered the hello and with servers that predate it
+    uint32_t Capabilities() {
+        return this->m_connection ? this->m_connection->Capabilities() : 0;
+    }
+
+    // Handshakes so far, how many resumed the previous session and their CPU time
+    tlsresumption::stats TlsStats() const {
+        return this->tlsResumption ? this->tlsResumption->Stats() : tlsresumption::stats();
+    }
+
+    mpscqueue<OwnedMessage<T, Transport>>& IncomingMessages() {
         return this->qMessagesIn;
     }
 
+private:
+    // Runs the transport's handshake when it has one, then starts reading
+    void Handshake() {
+        if constexpr (Transport::handshake) {
+            if constexpr (Transport::secure) {
+                this->tlsResumption->Restore(this->m_connection->stream());
+            }
+            this->m_connection->stream().async_handshake(asio::ssl::stream_base::client, this->m_connection->Recycled(
+                [this](std::error_code hErr) {
+                    LOG(INFO, "Connected to server");
+                    if (!hErr) {
+                        this->ReadFromServer();
+                    } else {
+                        LOG(ERROR, "Handshake Error", hErr.message());
+                        this->Reconnect();
+                    }
+                })
+            );
+        } else {
+            LOG(INFO, "Connected to server");
+            this->ReadFromServer();
+        }
+    }
+
+    // Says hello before anything else is sent, then keeps reading
+    void ReadFromServer() {
+        Hello hello;
+        hello.type = this->clientType;
+        hello.capabilities = this->capabilities;
+        hello.deviceId = this->deviceId;
+        this->m_connection->Send(SocketConnection<T, Transport>::MakeHello(hello));
+
+        if (this->clientType == CUBE) {
+            LOG(INFO, "Initializing heartbeat");
+            this->Pulse();
+        }
+
+        this->m_connection->ReadHeaderFromServer(
+            [this](std::runtime_error rErr) {
+                LOG(ERROR, "Connection Error", rErr.what());
+                LOG(INFO, "Initiating autoconnect");
+                this->Reconnect();
+            }
+        );
+    }
+
 protected: 
     virtual void OnMessageRecieved(Message<T>& msg) {
 
     }
+
+    // Called for every piece of a body above InboundLimits::streamThreshold, in order
+    // msg.header.size is the size of the whole body, msg.body the bytes starting at offset
+    virtual void OnMessageChunkRecieved(Message<T>& msg, uint32_t offset, bool last) {
+
+    }
+
+private:
+    void Dispatch(OwnedMessage<T, Transport>& ownedMessage) {
+        if (ownedMessage.chunk.streamed) {
+            this->OnMessageChunkRecieved(ownedMessage.message, ownedMessage.chunk.offset, ownedMessage.chunk.last);
+        } else {
+            this->OnMessageRecieved(ownedMessage.message);
+        }
+    }
 };
\ No newline at end of file
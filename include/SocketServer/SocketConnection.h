@@ -1,18 +1,70 @@
 #pragma once
 
 #include <SocketServer/common.h>
+#include <SocketServer/mpscqueue.h>
+#include <SocketServer/handlermemory.h>
+#include <SocketServer/memorybudget.h>
 #include <stdexcept>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <vector>
 
 using asio::ip::tcp;
 
+// Defined, every connection reads and writes from coroutines instead of chained completion handlers
+// The API is the same either way, but the coroutines need a C++20 build
+#if defined(CONNECTION_COROUTINES) && !defined(ASIO_HAS_CO_AWAIT)
+#error "CONNECTION_COROUTINES needs C++20 coroutines, build with -std=c++20"
+#endif
+
 // foward declare
-template <typename T>
+template <typename T, typename Transport>
 class SocketServer;
 
 typedef asio::ssl::stream<asio::ip::tcp::socket> ssl_socket;
 
-template <typename T>
-class SocketConnection: public std::enable_shared_from_this<SocketConnection<T>> {
+// What a connection does with new messages once its outbound queue is above the high watermark
+enum class SlowConsumerPolicy {
+    // Keep queueing, the watermark callback still fires
+    none,
+    // Discard the oldest messages that are not already being written
+    drop_oldest,
+    // Discard the message being sent
+    drop_newest,
+    // Close the connection
+    disconnect,
+    // Replace a queued message with the same id, only the latest value is delivered
+    conflate
+};
+
+// Outbound queue limits of a connection, a limit of 0 is unbounded
+// A low watermark of 0 clears the congestion as soon as the queue is back under the high watermark
+struct OutboundLimits {
+    size_t highWatermarkBytes = 0;
+    size_t lowWatermarkBytes = 0;
+    size_t highWatermarkMessages = 0;
+    size_t lowWatermarkMessages = 0;
+
+    SlowConsumerPolicy policy = SlowConsumerPolicy::none;
+};
+
+// Inbound frame limits of a connection
+struct InboundLimits {
+    // A frame declaring more bytes than this closes the connection as soon as its header is read
+    size_t maxFrameSize = 16 * 1024 * 1024;
+
+    // Bodies larger than this are handed over in chunks as they arrive instead of being buffered whole, 0 never streams
+    size_t streamThreshold = 0;
+    // Raised to 1 if set to 0, which could never make progress
+    size_t streamChunkSize = 64 * 1024;
+};
+
+// Transport picks the stream the connection runs over, see transport.h
+template <typename T, typename Transport = tls_transport>
+class SocketConnection: public std::enable_shared_from_this<SocketConnection<T, Transport>> {
 public:
     // A SocketConnection is either owned by a server or a client and it behaves differently depending on who
     enum class owner {
@@ -20,40 +72,135 @@ public:
         client
     };
 
+    // Handles a frame on the io thread that parsed it, see SocketServer::SetInlineHandler
+    typedef std::function<void(std::shared_ptr<SocketConnection<T, Transport>>, Message<T>&)> inline_handler;
+
 protected:
     // This context is shared with the whole asio instance
     asio::io_context& asioContext;
-    asio::ssl::context& ssl_context;
+    typename Transport::context_type& transportContext;
+
+    // Every handler for this connection runs through its strand so they stay serialized
+    // even when the io_context is run from several threads
+    asio::strand<asio::io_context::executor_type> strand;
+
+    // Recycled storage for the handlers of every async operation on this connection
+    handler_memory handlerMemory;
 
     // Each SocketConnection has a unique socket to a remote 
-    ssl_socket _socket;
+    typename Transport::stream_type _socket;
+
+    // All messages to be sent to the remove side that are not being written yet
+    // Only ever touched from the connection's strand, so it needs no lock of its own
+    std::deque<Message<T>> qMessagesOut;
+
+    // Messages currently being written and their headers and bodies gathered into one write
+    std::vector<Message<T>> vecMessagesInFlight;
+    std::vector<asio::const_buffer> vecWriteBuffers;
+
+    // Bytes of every queued and in flight message, headers included
+    size_t nQueuedBytes = 0;
+    size_t nInFlightBytes = 0;
+
+    OutboundLimits outboundLimits;
+    std::function<void(bool)> onWatermark;
 
-    // All messages to be sent to the remove side
-    tsqueue<Message<T>> qMessagesOut;
+    // Set above the high watermark until the queue drains below the low one, readable from any thread
+    std::atomic<bool> bCongested { false };
+    std::atomic<uint64_t> nDroppedMessages { 0 };
+    std::atomic<bool> bDropWhenCongested { false };
+
+    // Upper bound of bytes gathered into a single write, at least one message is always sent
+    size_t nWriteBudget = 64 * 1024;
 
     // All messages that are incoming to the parent
-    tsqueue<OwnedMessage<T>>& qMessagesIn;
+    mpscqueue<OwnedMessage<T, Transport>>& qMessagesIn;
 
     // A temporary message ato be passed around
     Message<T> msgTmpIn;
 
+    // Bytes received but not yet parsed into frames, a read fills as much of it as is available
+    static constexpr size_t READ_BUFFER_SIZE = 16 * 1024;
+    std::vector<uint8_t> vecReadBuffer = std::vector<uint8_t>(READ_BUFFER_SIZE);
+    size_t nReadBytes = 0;
+
+    InboundLimits inboundLimits;
+
+    // The body being streamed and how much of it is still to come
+    MessageHeader<T> streamHeader;
+    size_t nStreamOffset = 0;
+    size_t nStreamRemaining = 0;
+
+    // Bytes of queued messages and receive buffer growth held by this connection, also charged to the shared budget if there is one
+    // The receive buffer only counts beyond READ_BUFFER_SIZE, so an idle connection costs nothing
+    // Inbound messages are only counted on the server, where the registry keeps the connection alive until they are handled
+    std::atomic<size_t> nMemoryBytes { 0 };
+    size_t nMemoryLimit = 0;
+    memorybudget* memoryBudget;
+
+    // Set while reading is paused for lack of memory or room in the inbound queue, resumeRead re-arms the read that was skipped
+    std::atomic<bool> bReadPaused { false };
+    bool bWaitingForBudget = false;
+
+    // Receive buffer bytes beyond READ_BUFFER_SIZE that are charged, only non zero while a large frame comes in
+    size_t nReadBufferCharge = 0;
+    // Size of the validated frame left incomplete at the front of the receive buffer, 0 if there is none
+    size_t nPartialFrame = 0;
+
+    // A message the full inbound queue turned away, parsing stops behind it until it is queued
+    OwnedMessage<T, Transport> pendingIn;
+    bool bInboundPending = false;
+    bool bWaitingForQueue = false;
+    std::function<void()> resumeRead;
+#if defined(CONNECTION_COROUTINES)
+    // A paused read loop waits on this until resumeRead cancels it
+    asio::steady_timer readWake { this->strand };
+    // The write loop waits on this while there is nothing to send, queueing a message cancels it
+    asio::steady_timer writeWake { this->strand };
+    bool bWriteLoopRunning = false;
+#endif
+
+    // What the peer announced in its hello, written once before bGreeted is set
+    Hello peerHello;
+    std::atomic<bool> bGreeted { false };
+    // Capabilities both sides support, known once the hello exchange is done
+    std::atomic<uint32_t> nCapabilities { 0 };
+
+    // Where the server registered the connection, set once it is approved
+    slothandle handle;
+
+    // Ids the server handles as soon as they are parsed, owned by the server and left alone once it started
+    const std::unordered_map<uint32_t, inline_handler>* inlineHandlers = nullptr;
+    // Set on the strand while an inline handler runs
+    bool bInlineHandling = false;
+
     owner ownerType;
 
 public:
-    SocketConnection(owner parent, asio::io_context& asioContext, asio::ssl::context& ssl_context, tsqueue<OwnedMessage<T>>& qIn)
-        : asioContext(asioContext), ssl_context(ssl_context), _socket(asioContext, ssl_context), qMessagesIn(qIn)
+    SocketConnection(owner parent, asio::io_context& asioContext, typename Transport::context_type& transportContext, mpscqueue<OwnedMessage<T, Transport>>& qIn, memorybudget* budget = nullptr)
+        : asioContext(asioContext), transportContext(transportContext), strand(asio::make_strand(asioContext)),
+          _socket(Transport::make_stream(strand, transportContext)), qMessagesIn(qIn), memoryBudget(budget)
     {
         this->ownerType = parent;
     }
 
-    virtual ~SocketConnection() {}
+    virtual ~SocketConnection() {
+        if (this->memoryBudget) {
+            this->memoryBudget->release(this->nMemoryBytes.load());
+        }
+    }
 
 public:
-    ssl_socket& ssl_socket_stream() {
+    asio::io_context& context() {
+        return this->asioContext;
+    }
+
+    // The TLS stream, or the socket itself on transports without TLS
+    typename Transport::stream_type& stream() {
         return this->_socket;
     }
 
-    ssl_socket::lowest_layer_type& socket() {
+    typename Transport::socket_type& socket() {
         return this->_socket.lowest_layer();
     }
 
@@ -78,6 +225,129 @@ public:
         return this->socket().is_open();
     }
 
+    // Unlike socket().remote_endpoint() this doesn't throw once the socket is closed
+    typename Transport::endpoint_type RemoteEndpoint() {
+        std::error_code err;
+        return this->socket().remote_endpoint(err);
+    }
+
+    // Binds a completion handler to this connection's recycled handler storage
+    template<typename Handler>
+    custom_alloc_handler<typename std::decay<Handler>::type> Recycled(Handler&& handler) {
+        return make_custom_alloc_handler(this->handlerMemory, std::forward<Handler>(handler));
+    }
+
+    // ASYNC - Runs handler on the connection's strand
+    template<typename Handler>
+    void Post(Handler&& handler) {
+        asio::post(this->strand, this->Recycled(std::forward<Handler>(handler)));
+    }
+
+    // Sets how many bytes of queued messages may be coalesced into a single write
+    void SetWriteBudget(size_t bytes) {
+        asio::post(this->strand, this->Recycled([this, bytes]() { this->nWriteBudget = bytes; }));
+    }
+
+    // Sets the outbound watermarks and what happens to messages sent while above them
+    void SetOutboundLimits(const OutboundLimits& limits) {
+        asio::post(this->strand, this->Recycled([this, limits]() {
+            this->outboundLimits = limits;
+            this->bDropWhenCongested.store(limits.policy == SlowConsumerPolicy::drop_newest, std::memory_order_relaxed);
+        }));
+    }
+
+    // Sets the largest accepted frame and which bodies are streamed in chunks
+    void SetInboundLimits(const InboundLimits& limits) {
+        InboundLimits clamped = limits;
+        clamped.streamChunkSize = std::max<size_t>(clamped.streamChunkSize, 1);
+        asio::post(this->strand, this->Recycled([this, clamped]() { this->inboundLimits = clamped; }));
+    }
+
+    // Pauses reading while this connection holds more than bytes of queued messages and grown receive buffer, 0 is unbounded
+    void SetMemoryLimit(size_t bytes) {
+        asio::post(this->strand, this->Recycled([this, bytes]() { this->nMemoryLimit = bytes; }));
+    }
+
+    size_t MemoryInUse() const {
+        return this->nMemoryBytes.load(std::memory_order_relaxed);
+    }
+
+    bool IsReadPaused() const {
+        return this->bReadPaused.load(std::memory_order_relaxed);
+    }
+
+    // Returns the memory of an inbound message once its handler is done with it, callable from any thread
+    void ReleaseInbound(size_t bytes) {
+        this->nMemoryBytes.fetch_sub(bytes);
+        if (this->memoryBudget) {
+            this->memoryBudget->release(bytes);
+        }
+
+        if (this->bReadPaused.load()) {
+            asio::post(this->strand, this->Recycled([self = this->shared_from_this()]() { self->ResumeRead(); }));
+        }
+    }
+
+    // Called on the connection's strand with true when the outbound queue crosses the high watermark
+    // and with false once it has drained below the low watermark
+    void SetWatermarkHandler(std::function<void(bool)> handler) {
+        asio::post(this->strand, this->Recycled([this, handler]() { this->onWatermark = handler; }));
+    }
+
+    // Only set and read on the server while it holds the connection's shard lock, or on the strand before reading starts
+    void SetHandle(slothandle handle) {
+        this->handle = handle;
+    }
+
+    slothandle Handle() const {
+        return this->handle;
+    }
+
+    // Must be set before reading starts
+    void SetInlineHandlers(const std::unordered_map<uint32_t, inline_handler>* handlers) {
+        this->inlineHandlers = handlers;
+    }
+
+    // Frame that carries hello to the peer
+    static Message<T> MakeHello(const Hello& hello) {
+        Message<T> msg;
+        msg.header.id = (T)HELLO_FRAME_ID;
+        msg << hello;
+        return msg;
+    }
+
+    // True once the peer sent its hello, peers that predate the hello never do
+    bool Greeted() const {
+        return this->bGreeted.load(std::memory_order_acquire);
+    }
+
+    // What the peer announced in its hello, a default Hello until then
+    Hello PeerHello() const {
+        return this->Greeted() ? this->peerHello : Hello();
+    }
+
+    // Records the capabilities negotiated with the peer
+    void Negotiate(uint32_t capabilities) {
+        this->nCapabilities.store(capabilities, std::memory_order_relaxed);
+    }
+
+    uint32_t Capabilities() const {
+        return this->nCapabilities.load(std::memory_order_relaxed);
+    }
+
+    bool Supports(Capability capability) const {
+        return (this->Capabilities() & capability) != 0;
+    }
+
+    bool IsCongested() const {
+        return this->bCongested.load(std::memory_order_relaxed);
+    }
+
+    // Messages discarded by the slow consumer policy
+    uint64_t DroppedMessages() const {
+        return this->nDroppedMessages.load(std::memory_order_relaxed);
+    }
+
     // bool IsConnected() const {
     //     // Can't call this->socket() here
     //     // return this->socket().is_open();
@@ -86,167 +356,625 @@ public:
 
 public:
     // ASYNC - Send a message
+    // Copying msg only shares its body, nothing is copied per recipient
     void Send(const Message<T>& msg) {
-        asio::post(this->asioContext, 
-            [this, msg]() {
-                bool isWritingMessage = !this->qMessagesOut.empty();
-                this->qMessagesOut.push_back(msg);
-                if (!isWritingMessage) {
-                    this->WriteHeader();
-                }
+        // A congested peer that drops new messages doesn't need to cost the sender a post
+        if (this->bDropWhenCongested.load(std::memory_order_relaxed) && this->IsCongested()) {
+            this->nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // An inline handler answering its sender is queued right away, nothing of the write path is on the stack then
+        if (this->strand.running_in_this_thread() && this->bInlineHandling) {
+            this->Enqueue(Message<T>(msg));
+            return;
+        }
+
+        // A server connection can lose its last owner before the strand gets to msg, the post keeps it alive.
+        // The client owns its connection outright and has no shared owner to hold
+        asio::post(this->strand, this->Recycled(
+            [this, self = this->weak_from_this().lock(), msg = msg]() mutable {
+                this->Enqueue(std::move(msg));
+            }
+        ));
+    }
+
+#if defined(CONNECTION_COROUTINES)
+    // ASYNC - Start the read and write loops on the client, they run until the connection fails
+    void ReadHeaderFromClient(SocketServer<T, Transport>* server, std::shared_ptr<SocketConnection<T, Transport>> conn) {
+        asio::co_spawn(this->strand, this->RunLoops(),
+            [this, server, conn](std::exception_ptr, std::error_code err) {
+                LOG(INFO, "Disconnected from client", this->RemoteEndpoint());
+                this->Disconnect();
+
+                server->connectionClosed(conn);
+                LOG(DEBUG, "Client connection has been removed from store");
+            }
+        );
+    }
+
+    // ASYNC - Start the read and write loops on the server, they run until the connection fails
+    template<typename ErrorCompletion>
+    void ReadHeaderFromServer(ErrorCompletion&& handler) {
+        asio::co_spawn(this->strand, this->RunLoops(),
+            [this, handler](std::exception_ptr, std::error_code err) {
+                this->Disconnect();
+                handler(std::runtime_error("Unexpectedly disconnected from the server"));
             }
         );
     }
+#else
+    // ASYNC - Prime context to read whatever the server sent, every complete frame is queued before re-arming
+    void ReadHeaderFromClient(SocketServer<T, Transport>* server, std::shared_ptr<SocketConnection<T, Transport>> conn) {
+        this->_socket.async_read_some(asio::buffer(this->vecReadBuffer.data() + this->nReadBytes, this->vecReadBuffer.size() - this->nReadBytes),
+            this->Recycled([this, server, conn](std::error_code err, std::size_t length) {
+                if (!err) {
+                    this->nReadBytes += length;
+                    if (!this->ParseFrames()) {
+                        err = asio::error::message_size;
+                    }
+                }
 
-    void ReadHeaderFromClient(SocketServer<T>* server, std::shared_ptr<SocketConnection<T>> conn) {
-        asio::async_read(this->_socket, asio::buffer(&this->msgTmpIn.header, sizeof(MessageHeader<T>)),
-            [this, server, conn](std::error_code err, std::size_t length) {
                 if (!err) {
-                    // Check if the header just read also has a body
-                    if (this->msgTmpIn.header.size > 0) {
-                        // It would be nice to know what else was sent...
-                        this->msgTmpIn.body.resize(this->msgTmpIn.header.size);
-                        
-                        this->ReadBodyFromClient(server, conn);
+                    if (this->bInboundPending || this->OverMemoryLimit()) {
+                        this->PauseRead([this, server, conn]() { this->ReadHeaderFromClient(server, conn); });
                     } else {
-                        this->AddToIncomingMessageQueueFromClient(server, conn);
+                        this->ReadHeaderFromClient(server, conn);
                     }
                 } else {
-                    LOG(INFO, "Disconnected from client", this->socket().remote_endpoint());
+                    LOG(INFO, "Disconnected from client", this->RemoteEndpoint());
                     this->Disconnect();
                     
-                    server->removeConnection(conn);
+                    server->connectionClosed(conn);
                     LOG(DEBUG, "Client connection has been removed from store");
                 }
-            }
+            })
         );
     }
 
-    // ASYNC - Prime context ready to read a message header
+    // ASYNC - Prime context to read whatever the server sent, every complete frame is queued before re-arming
     template<typename ErrorCompletion>
     void ReadHeaderFromServer(ErrorCompletion&& handler) {
-        asio::async_read(this->_socket, asio::buffer(&this->msgTmpIn.header, sizeof(MessageHeader<T>)),
-            [this, handler](std::error_code err, std::size_t length) {
+        this->_socket.async_read_some(asio::buffer(this->vecReadBuffer.data() + this->nReadBytes, this->vecReadBuffer.size() - this->nReadBytes),
+            this->Recycled([this, handler](std::error_code err, std::size_t length) {
                 if (!err) {
-                    // Check if the header just read also has a body
-                    if (this->msgTmpIn.header.size > 0) {
-                        // It would be nice to know what else was sent...
-                        this->msgTmpIn.body.resize(this->msgTmpIn.header.size);
-                        
-                        this->ReadBodyFromServer(handler);
+                    this->nReadBytes += length;
+                    if (!this->ParseFrames()) {
+                        err = asio::error::message_size;
+                    }
+                }
+
+                if (!err) {
+                    if (this->bInboundPending || this->OverMemoryLimit()) {
+                        this->PauseRead([this, handler]() { this->ReadHeaderFromServer(handler); });
                     } else {
-                        this->AddToIncomingMessageQueueFromServer(handler);
+                        this->ReadHeaderFromServer(handler);
                     }
                 } else {
                     this->Disconnect();
                     handler(std::runtime_error("Unexpectedly disconnected from the server"));
                 }
-            }
+            })
         );
     }
+#endif
 
 private:
-    // ASYNC - Prime context to write a message header
-    void WriteHeader() {
-        asio::async_write(this->_socket, asio::buffer(&this->qMessagesOut.front().header, sizeof(MessageHeader<T>)),
-            [this](std::error_code err, std::size_t length) {
-                if (!err) {
-                    // Check if the message header just sent also had a body
-                    if (this->qMessagesOut.front().body.size() > 0) {
-                        // It would be nice to also send the body...
-                        this->WriteBody();
-                    } else {
-                        this->qMessagesOut.pop_front();
-
-                        // If the queue isn't empty, keep working
-                        if (!this->qMessagesOut.empty()) {
-                            this->WriteHeader();
-                        }
-                    }
-                } else {
-                    LOG(ERROR, "Write header fail -- closing socket", this->socket().remote_endpoint(), err.message());
+    // Applies the slow consumer policy and queues msg, must run on the strand
+    void Enqueue(Message<T>&& msg) {
+        size_t msgBytes = sizeof(MessageHeader<T>) + msg.body.size();
+
+        if (this->AboveHighWatermark(msgBytes, 1)) {
+            // The policies below keep the queue at the high watermark, so it counts as crossing it
+            this->SetCongested(true);
+
+            switch (this->outboundLimits.policy) {
+                case SlowConsumerPolicy::drop_newest:
+                    this->nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                case SlowConsumerPolicy::disconnect:
+                    LOG(INFO, "Slow consumer -- closing socket", this->RemoteEndpoint());
                     this->Disconnect();
-                }
+                    return;
+                case SlowConsumerPolicy::conflate:
+                    if (this->Conflate(msg, msgBytes)) {
+                        return;
+                    }
+                    break;
+                case SlowConsumerPolicy::drop_oldest:
+                case SlowConsumerPolicy::none:
+                    break;
             }
-        );
+        }
+
+        this->qMessagesOut.push_back(std::move(msg));
+        this->nQueuedBytes += msgBytes;
+        this->ChargeMemory(msgBytes);
+
+        // The messages in flight can't be taken back and the one just queued is always kept
+        if (this->outboundLimits.policy == SlowConsumerPolicy::drop_oldest) {
+            while (this->qMessagesOut.size() > 1 && this->QueuedAboveHighWatermark()) {
+                size_t droppedBytes = sizeof(MessageHeader<T>) + this->qMessagesOut.front().body.size();
+                this->nQueuedBytes -= droppedBytes;
+                this->qMessagesOut.pop_front();
+                this->ReleaseMemory(droppedBytes);
+                this->nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        this->UpdateWatermark();
+
+        if (this->vecMessagesInFlight.empty() && !this->qMessagesOut.empty()) {
+            this->WriteMessages();
+        }
+    }
+
+    // True if the queue would be above the high watermark with the extra bytes and messages
+    bool AboveHighWatermark(size_t extraBytes, size_t extraMessages) const {
+        size_t messages = this->qMessagesOut.size() + this->vecMessagesInFlight.size() + extraMessages;
+        return (this->outboundLimits.highWatermarkBytes > 0 && this->nQueuedBytes + extraBytes > this->outboundLimits.highWatermarkBytes)
+            || (this->outboundLimits.highWatermarkMessages > 0 && messages > this->outboundLimits.highWatermarkMessages);
+    }
+
+    // True if the messages that are not in flight yet are above the high watermark on their own
+    bool QueuedAboveHighWatermark() const {
+        size_t bytes = this->nQueuedBytes - this->nInFlightBytes;
+        return (this->outboundLimits.highWatermarkBytes > 0 && bytes > this->outboundLimits.highWatermarkBytes)
+            || (this->outboundLimits.highWatermarkMessages > 0 && this->qMessagesOut.size() > this->outboundLimits.highWatermarkMessages);
+    }
+
+    // Replaces the newest queued message with the same id, returns false if there is none
+    bool Conflate(Message<T>& msg, size_t msgBytes) {
+        for (auto it = this->qMessagesOut.rbegin(); it != this->qMessagesOut.rend(); it++) {
+            if (it->header.id == msg.header.id) {
+                size_t replacedBytes = sizeof(MessageHeader<T>) + it->body.size();
+                this->nQueuedBytes -= replacedBytes;
+                this->nQueuedBytes += msgBytes;
+                *it = std::move(msg);
+                this->ChargeMemory(msgBytes);
+                this->ReleaseMemory(replacedBytes);
+                this->nDroppedMessages.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
     }
 
-    void WriteBody() {
-        asio::async_write(this->_socket, asio::buffer(this->qMessagesOut.front().body.data(), this->qMessagesOut.front().body.size()),
-            [this](std::error_code err, std::size_t length) {
+    void UpdateWatermark() {
+        if (!this->IsCongested() && this->AboveHighWatermark(0, 0)) {
+            this->SetCongested(true);
+        } else if (this->IsCongested()) {
+            // Only the dimensions with a high watermark can hold the congestion
+            size_t messages = this->qMessagesOut.size() + this->vecMessagesInFlight.size();
+            size_t lowBytes = this->outboundLimits.lowWatermarkBytes > 0 ? this->outboundLimits.lowWatermarkBytes : this->outboundLimits.highWatermarkBytes;
+            size_t lowMessages = this->outboundLimits.lowWatermarkMessages > 0 ? this->outboundLimits.lowWatermarkMessages : this->outboundLimits.highWatermarkMessages;
+            bool bytesCleared = this->outboundLimits.highWatermarkBytes == 0 || this->nQueuedBytes <= lowBytes;
+            bool messagesCleared = this->outboundLimits.highWatermarkMessages == 0 || messages <= lowMessages;
+            if (bytesCleared && messagesCleared) {
+                this->SetCongested(false);
+            }
+        }
+    }
+
+    void SetCongested(bool congested) {
+        if (this->bCongested.exchange(congested, std::memory_order_relaxed) != congested && this->onWatermark) {
+            this->onWatermark(congested);
+        }
+    }
+
+#if defined(CONNECTION_COROUTINES)
+    // Wakes the write loop if it waits for messages, must run on the strand
+    void WriteMessages() {
+        this->writeWake.cancel();
+    }
+
+    // Runs the write loop next to the read loop and only completes once both are over
+    // Whoever holds the connection in the completion can let it go, no loop touches it anymore
+    asio::awaitable<std::error_code> RunLoops() {
+        this->bWriteLoopRunning = true;
+        asio::co_spawn(this->strand, this->WriteLoop(), asio::detached);
+
+        std::error_code err = co_await this->ReadLoop();
+        this->Disconnect();
+
+        // The write loop sees the closed socket once it is woken and wakes us on its way out
+        while (this->bWriteLoopRunning) {
+            this->writeWake.cancel();
+            this->writeWake.expires_at(asio::steady_timer::time_point::max());
+            std::error_code woken;
+            co_await this->writeWake.async_wait(asio::redirect_error(asio::use_awaitable, woken));
+        }
+        co_return err;
+    }
+
+    // Writes everything queued in gathered writes and waits on writeWake while the queue is empty
+    asio::awaitable<void> WriteLoop() {
+        while (this->IsConnected()) {
+            if (this->qMessagesOut.empty()) {
+                this->writeWake.expires_at(asio::steady_timer::time_point::max());
+                std::error_code woken;
+                co_await this->writeWake.async_wait(asio::redirect_error(asio::use_awaitable, woken));
+                continue;
+            }
+
+            this->GatherMessages();
+            std::error_code err;
+            co_await asio::async_write(this->_socket, this->vecWriteBuffers, asio::redirect_error(asio::use_awaitable, err));
+            if (err) {
+                LOG(ERROR, "Write fail -- closing socket", this->RemoteEndpoint(), err.message());
+                this->Disconnect();
+                break;
+            }
+
+            this->MessagesWritten();
+        }
+
+        this->bWriteLoopRunning = false;
+        this->writeWake.cancel();
+    }
+
+    // Reads until the connection fails and queues every complete frame, returns why it stopped
+    // One frame serves every read of the connection, pausing for memory is just another suspension
+    asio::awaitable<std::error_code> ReadLoop() {
+        std::error_code err;
+        while (!err) {
+            std::size_t length = co_await this->_socket.async_read_some(
+                asio::buffer(this->vecReadBuffer.data() + this->nReadBytes, this->vecReadBuffer.size() - this->nReadBytes),
+                asio::redirect_error(asio::use_awaitable, err));
+            if (err) {
+                break;
+            }
+
+            this->nReadBytes += length;
+            if (!this->ParseFrames()) {
+                err = asio::error::message_size;
+            } else if (this->bInboundPending || this->OverMemoryLimit()) {
+                this->readWake.expires_at(asio::steady_timer::time_point::max());
+                this->PauseRead([this]() { this->readWake.cancel(); });
+
+                // PauseRead resumes right away if there is room again by now
+                if (this->bReadPaused.load()) {
+                    std::error_code cancelled;
+                    co_await this->readWake.async_wait(asio::redirect_error(asio::use_awaitable, cancelled));
+                }
+            }
+        }
+        co_return err;
+    }
+#else
+    // ASYNC - Prime context to write every queued message (headers and bodies) in one gathered write
+    void WriteMessages() {
+        this->GatherMessages();
+
+        // The write holds the connection like Send does, the buffers are ours until it completes
+        asio::async_write(this->_socket, this->vecWriteBuffers,
+            this->Recycled([this, self = this->weak_from_this().lock()](std::error_code err, std::size_t length) {
                 if (!err) {
-                    // Sending was successful so we are done with this message
-                    this->qMessagesOut.pop_front();
+                    this->MessagesWritten();
 
-                    // If there are still messages to send, issue a task to write the header
+                    // If more messages were queued while writing, send them too
                     if (!this->qMessagesOut.empty()) {
-                        this->WriteHeader();
+                        this->WriteMessages();
                     }
                 } else {
-                    LOG(ERROR, "Write body fail -- closing socket", this->socket().remote_endpoint(), err.message());
+                    LOG(ERROR, "Write fail -- closing socket", this->RemoteEndpoint(), err.message());
                     this->Disconnect();
                 }
-            }
+            })
         );
     }
+#endif
+
+    // Moves as many queued messages as the write budget allows in flight and gathers their headers and bodies
+    // The ssl stream linearises small buffers, so the gathered messages leave as a few large records
+    void GatherMessages() {
+        this->vecWriteBuffers.clear();
+        this->vecMessagesInFlight.clear();
+        this->nInFlightBytes = 0;
+
+        // In flight messages leave the queue so the slow consumer policy never touches what is being written
+        while (!this->qMessagesOut.empty()) {
+            size_t msgBytes = sizeof(MessageHeader<T>) + this->qMessagesOut.front().body.size();
+            if (!this->vecMessagesInFlight.empty() && this->nInFlightBytes + msgBytes > this->nWriteBudget) {
+                break;
+            }
 
-    // ASYNC - Prime context ready to read a message body
-    void ReadBodyFromClient(SocketServer<T>* server, std::shared_ptr<SocketConnection<T>> conn) {
-        // If this function is called then that means the header has already been read and in the request we have a body
-        // The space for that body has already been allocated in the msgTmpIn object
-        asio::async_read(this->_socket, asio::buffer(this->msgTmpIn.body.data(), this->msgTmpIn.body.size()),
-            [this, server, conn](std::error_code err, std::size_t length) {
-                if (!err) {
-                    this->AddToIncomingMessageQueueFromClient(server, conn);
-                } else {
-                    LOG(ERROR, "Read body fail -- closing socket to client", this->socket().remote_endpoint(), err.message());
-                    this->Disconnect();
-                }
+            this->vecMessagesInFlight.push_back(std::move(this->qMessagesOut.front()));
+            this->qMessagesOut.pop_front();
+            this->nInFlightBytes += msgBytes;
+        }
+
+        for (auto& msg : this->vecMessagesInFlight) {
+            this->vecWriteBuffers.push_back(asio::buffer(&msg.header, sizeof(MessageHeader<T>)));
+            if (msg.body.size() > 0) {
+                this->vecWriteBuffers.push_back(asio::buffer(msg.body.data(), msg.body.size()));
             }
-        );
+        }
     }
 
-    template<typename ErrorCompletion>
-    void ReadBodyFromServer(ErrorCompletion&& handler) {
-        // If this function is called then that means the header has already been read and in the request we have a body
-        // The space for that body has already been allocated in the msgTmpIn object
-        asio::async_read(this->_socket, asio::buffer(this->msgTmpIn.body.data(), this->msgTmpIn.body.size()),
-            [this, handler](std::error_code err, std::size_t length) {
-                if (!err) {
-                    this->AddToIncomingMessageQueueFromServer(handler);
-                } else {
-                    LOG(ERROR, "Read body fail -- closing socket to server", err.message());
-                    this->Disconnect();
-                    handler(std::runtime_error("Disconnected from server after read body fail"));
-                }
-            }
-        );
+    // Sending was successful so we are done with the messages in flight
+    void MessagesWritten() {
+        this->vecMessagesInFlight.clear();
+        this->nQueuedBytes -= this->nInFlightBytes;
+        this->ReleaseMemory(this->nInFlightBytes);
+        this->nInFlightBytes = 0;
+        this->UpdateWatermark();
     }
 
-    void AddToIncomingMessageQueueFromClient(SocketServer<T>* server, std::shared_ptr<SocketConnection<T>> conn) {
-        // If it is a server, throw it into the queue as a "owned message"
-        if (this->ownerType == owner::server) {
-            this->qMessagesIn.push_back({ this->shared_from_this(), this->msgTmpIn });
+    void ChargeMemory(size_t bytes) {
+        this->nMemoryBytes.fetch_add(bytes);
+        if (this->memoryBudget) {
+            this->memoryBudget->charge(bytes);
+        }
+    }
+
+    // Must run on the strand
+    void ReleaseMemory(size_t bytes) {
+        this->nMemoryBytes.fetch_sub(bytes);
+        if (this->memoryBudget) {
+            this->memoryBudget->release(bytes);
+        }
+
+        if (this->bReadPaused.load()) {
+            this->ResumeRead();
+        }
+    }
+
+    // The frame being received already has its memory, pausing halfway through it would only hold that memory longer
+    bool OverMemoryLimit() const {
+        return !this->HoldsLargeFrame() && this->MemoryExhausted();
+    }
+
+    bool HoldsLargeFrame() const {
+        return this->nPartialFrame > READ_BUFFER_SIZE && this->vecReadBuffer.size() >= this->nPartialFrame;
+    }
+
+    bool MemoryExhausted() const {
+        return (this->nMemoryLimit > 0 && this->nMemoryBytes.load() >= this->nMemoryLimit)
+            || (this->memoryBudget && this->memoryBudget->exhausted());
+    }
+
+    // Leaves the read unarmed until the inbound queue has room and enough memory is released, must run on the strand
+    void PauseRead(std::function<void()> resume) {
+        LOG(DEBUG, this->bInboundPending ? "Inbound queue full -- pausing reads" : "Memory budget exhausted -- pausing reads", this->RemoteEndpoint());
+        this->resumeRead = std::move(resume);
+        // Pairs with the releases, which check the flag after giving their memory back
+        this->bReadPaused.store(true);
+        if (this->bInboundPending) {
+            this->RetryInbound();
         } else {
-            this->qMessagesIn.push_back({ nullptr, this->msgTmpIn });
+            this->ResumeRead();
         }
+    }
 
-        this->msgTmpIn.clear();
+    // Queues the message the inbound queue turned away and parses the frames buffered behind it, must run on the strand
+    // The queue calls back once the consumer made room, so a full queue never spins the io thread
+    void RetryInbound() {
+        if (!this->qMessagesIn.try_push(std::move(this->pendingIn))) {
+            if (!this->bWaitingForQueue) {
+                this->bWaitingForQueue = true;
+                // A client owns its connection outright and can't drop it while the read is paused
+                std::weak_ptr<SocketConnection<T, Transport>> weakConn = this->weak_from_this();
+                bool owned = this->ownerType == owner::client;
+                this->qMessagesIn.wait_for_space([this, weakConn, owned]() {
+                    std::shared_ptr<SocketConnection<T, Transport>> conn = weakConn.lock();
+                    if (conn || owned) {
+                        asio::post(this->strand, this->Recycled([this, conn]() {
+                            this->bWaitingForQueue = false;
+                            this->RetryInbound();
+                        }));
+                    }
+                });
+            }
+            return;
+        }
+
+        this->pendingIn = OwnedMessage<T, Transport>();
+        this->bInboundPending = false;
 
-        this->ReadHeaderFromClient(server, conn);
+        // A frame above the limit closes the socket here and the resumed read reports it
+        this->ParseFrames();
+        if (this->bInboundPending) {
+            this->RetryInbound();
+            return;
+        }
+        this->ResumeRead();
     }
 
-    template<typename ErrorCompletion>
-    void AddToIncomingMessageQueueFromServer(ErrorCompletion&& handler) {
+    // Re-arms a paused read if there is memory again, must run on the strand
+    void ResumeRead() {
+        if (!this->bReadPaused.load() || this->bInboundPending) {
+            return;
+        }
+
+        // A large frame that was refused its room takes it as soon as there is memory again
+        this->FitReadBuffer();
+        bool holdsLargeFrame = this->HoldsLargeFrame();
+
+        // The shared budget calls back once something anywhere is released
+        if (!holdsLargeFrame && this->memoryBudget && this->memoryBudget->exhausted()) {
+            if (!this->bWaitingForBudget) {
+                this->bWaitingForBudget = true;
+                std::weak_ptr<SocketConnection<T, Transport>> weakConn = this->weak_from_this();
+                this->memoryBudget->wait([weakConn]() {
+                    if (auto conn = weakConn.lock()) {
+                        asio::post(conn->strand, conn->Recycled([conn]() {
+                            conn->bWaitingForBudget = false;
+                            conn->ResumeRead();
+                        }));
+                    }
+                });
+            }
+            return;
+        }
+
+        // Our own releases call back once this connection is below its limit
+        if (!holdsLargeFrame && this->nMemoryLimit > 0 && this->nMemoryBytes.load() >= this->nMemoryLimit) {
+            return;
+        }
+
+        LOG(DEBUG, "Memory available again -- resuming reads", this->RemoteEndpoint());
+        this->bReadPaused.store(false);
+        std::function<void()> resume = std::move(this->resumeRead);
+        this->resumeRead = nullptr;
+        resume();
+    }
+
+    // Queues every complete frame sitting in the receive buffer and keeps the trailing partial frame for the next read
+    // Returns false when the peer declared a frame above the limit, the connection is closed by then
+    bool ParseFrames() {
+        size_t offset = 0;
+        // Only ever taken from a header that passed the checks
+        this->nPartialFrame = 0;
+        while (this->nReadBytes > offset && !this->bInboundPending) {
+            // Whatever arrived of a streamed body goes straight to the handler
+            if (this->nStreamRemaining > 0) {
+                size_t length = std::min({ this->nReadBytes - offset, this->nStreamRemaining, this->inboundLimits.streamChunkSize });
+                const uint8_t* body = this->vecReadBuffer.data() + offset;
+
+                MessageChunk chunk;
+                chunk.streamed = true;
+                chunk.offset = (uint32_t)this->nStreamOffset;
+                chunk.last = length == this->nStreamRemaining;
+
+                this->msgTmpIn.header = this->streamHeader;
+                this->msgTmpIn.body.assign(body, body + length);
+                this->AddToIncomingMessageQueue(chunk);
+
+                this->nStreamOffset += length;
+                this->nStreamRemaining -= length;
+                offset += length;
+                continue;
+            }
+
+            if (this->nReadBytes - offset < sizeof(MessageHeader<T>)) {
+                break;
+            }
+
+            MessageHeader<T> header;
+            std::memcpy(&header, this->vecReadBuffer.data() + offset, sizeof(MessageHeader<T>));
+
+            size_t frameSize = sizeof(MessageHeader<T>) + header.size;
+            if (frameSize > this->inboundLimits.maxFrameSize) {
+                LOG(ERROR, "Frame exceeds the maximum size -- closing socket", this->RemoteEndpoint(), std::to_string(frameSize));
+                this->Disconnect();
+                return false;
+            }
+
+            if (this->inboundLimits.streamThreshold > 0 && header.size > this->inboundLimits.streamThreshold) {
+                this->streamHeader = header;
+                this->nStreamOffset = 0;
+                this->nStreamRemaining = header.size;
+                offset += sizeof(MessageHeader<T>);
+                continue;
+            }
+
+            if (this->nReadBytes - offset < frameSize) {
+                this->nPartialFrame = frameSize;
+                break;
+            }
+
+            const uint8_t* body = this->vecReadBuffer.data() + offset + sizeof(MessageHeader<T>);
+            this->msgTmpIn.header = header;
+            this->msgTmpIn.body.assign(body, body + header.size);
+            this->AddToIncomingMessageQueue();
+
+            offset += frameSize;
+        }
+
+        // Move the partial frame to the front of the buffer
+        if (offset > 0) {
+            std::memmove(this->vecReadBuffer.data(), this->vecReadBuffer.data() + offset, this->nReadBytes - offset);
+            this->nReadBytes -= offset;
+        }
+
+        // While a message waits for the inbound queue the bytes behind it are unchecked, so the buffer stays as it is
+        if (!this->bInboundPending) {
+            this->FitReadBuffer();
+        }
+
+        return true;
+    }
+
+    // Makes room for a frame that is larger than the buffer and gives the room back once it is parsed, must run on the strand
+    // The room is charged like queued messages and only taken while the connection is within its limits, the read pauses otherwise
+    void FitReadBuffer() {
+        size_t needed = std::max(READ_BUFFER_SIZE, this->nPartialFrame);
+        if (needed > this->vecReadBuffer.size()) {
+            if (this->MemoryExhausted()) {
+                return;
+            }
+            this->vecReadBuffer.resize(needed);
+        } else if (needed == READ_BUFFER_SIZE && this->vecReadBuffer.size() > READ_BUFFER_SIZE && this->nReadBytes <= READ_BUFFER_SIZE) {
+            this->vecReadBuffer.resize(READ_BUFFER_SIZE);
+            this->vecReadBuffer.shrink_to_fit();
+        }
+
+        // Released without resuming, every caller decides about the read itself
+        size_t charge = this->vecReadBuffer.capacity() > READ_BUFFER_SIZE ? this->vecReadBuffer.capacity() - READ_BUFFER_SIZE : 0;
+        size_t previous = this->nReadBufferCharge;
+        this->nReadBufferCharge = charge;
+        if (charge > previous) {
+            this->ChargeMemory(charge - previous);
+        } else if (charge < previous) {
+            this->nMemoryBytes.fetch_sub(previous - charge);
+            if (this->memoryBudget) {
+                this->memoryBudget->release(previous - charge);
+            }
+        }
+    }
+
+    void AddToIncomingMessageQueue(const MessageChunk& chunk = MessageChunk()) {
+        // The client is done with the server's answer, the server still has to answer and file the connection
+        // A repeated or malformed hello goes nowhere
+        if ((uint32_t)this->msgTmpIn.header.id == HELLO_FRAME_ID && !chunk.streamed) {
+            bool greeted = this->Greet();
+            if (greeted && this->ownerType == owner::client) {
+                this->Negotiate(this->peerHello.capabilities);
+            }
+            if (!greeted || this->ownerType == owner::client) {
+                this->msgTmpIn.clear();
+                return;
+            }
+        }
+
+        // Ids with an inline handler skip the queue, so they can overtake the connection's queued messages
+        if (this->inlineHandlers && !chunk.streamed) {
+            auto handler = this->inlineHandlers->find((uint32_t)this->msgTmpIn.header.id);
+            if (handler != this->inlineHandlers->end()) {
+                this->bInlineHandling = true;
+                handler->second(this->shared_from_this(), this->msgTmpIn);
+                this->bInlineHandling = false;
+                this->msgTmpIn.clear();
+                return;
+            }
+        }
+
         // If it is a server, throw it into the queue as a "owned message"
+        // The body is moved into the queue, the handler and every recipient share it from there
+        OwnedMessage<T, Transport> ownedMessage { slothandle(), std::move(this->msgTmpIn), chunk };
         if (this->ownerType == owner::server) {
-            this->qMessagesIn.push_back({ this->shared_from_this(), this->msgTmpIn });
-        } else {
-            this->qMessagesIn.push_back({ nullptr, this->msgTmpIn });
+            this->ChargeMemory(sizeof(MessageHeader<T>) + ownedMessage.message.body.size());
+            ownedMessage.remote = this->handle;
+        }
+
+        // A full queue stops the parsing, the read loop pauses until RetryInbound got the message in
+        if (!this->qMessagesIn.try_push(std::move(ownedMessage))) {
+            this->pendingIn = std::move(ownedMessage);
+            this->bInboundPending = true;
         }
 
         this->msgTmpIn.clear();
+    }
+
+    // Takes the peer's hello out of msgTmpIn, only its first one counts
+    bool Greet() {
+        if (this->bGreeted.load(std::memory_order_relaxed) || this->msgTmpIn.body.size() < sizeof(Hello)) {
+            return false;
+        }
 
-        this->ReadHeaderFromServer(handler);
+        std::memcpy(&this->peerHello, this->msgTmpIn.body.data(), sizeof(Hello));
+        this->bGreeted.store(true, std::memory_order_release);
+        return true;
     }
 };
\ No newline at end of file
@@ -1,34 +1,95 @@
 #pragma once
 
 #include <SocketServer/common.h>
-#include <SocketServer/tsqueue.h>
+#include <SocketServer/mpscqueue.h>
+#include <SocketServer/handlermemory.h>
+#include <SocketServer/memorybudget.h>
+#include <SocketServer/slotmap.h>
+#include <SocketServer/subscriptionindex.h>
+#include <SocketServer/tlsresumption.h>
+#include <SocketServer/workerpool.h>
+#include <SocketServer/SocketConnection.h>
 
 #include <thread>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 using asio::ip::tcp;
 
-template<typename T>
+// Set on the threads that run the io_context of any server, whatever its message and transport types.
+// A broadcast made on one of them never waits on the io threads, which might be waiting on it in turn
+inline thread_local bool bServerIoThread = false;
+
+// Transport picks what the server listens on and how connections are secured, see transport.h
+template<typename T, typename Transport = tls_transport>
 class SocketServer {
 public:
+    // How the io threads are laid out
+    enum class threading {
+        // One io_context shared by every thread, connections are serialized by their strand
+        pool,
+        // One io_context, acceptor, connection set and inbound queue per thread (thread-per-core)
+        sharded
+    };
+
+    struct HandshakeMetrics {
+        uint64_t started = 0;
+        uint64_t completed = 0;
+        uint64_t failed = 0;
+        // Failed handshakes that were cut off by the deadline
+        uint64_t timedOut = 0;
+        size_t inProgress = 0;
+        // Accepted connections waiting for a handshake slot
+        size_t queued = 0;
+
+        // Time from accepting a connection until its handshake started
+        uint64_t totalQueueNanos = 0;
+        uint64_t maxQueueNanos = 0;
+
+        double averageQueueMicros() const {
+            return this->started > 0 ? (double)this->totalQueueNanos / (double)this->started / 1000.0 : 0.0;
+        }
+    };
+
     // Create the server and listen to the desired port
-    SocketServer(uint16_t port, std::string certPath, std::string keyPath, std::string caPath)
-        : acceptor(io_context, tcp::endpoint(tcp::v4(), port)), ssl_context(asio::ssl::context::sslv23), 
-          certPath(certPath), keyPath(keyPath), caPath(caPath)
+    // threadCount is the number of threads that run the io_context, each connection is bound to its own strand
+    // In sharded mode threadCount is the number of shards, each one is run by its own thread
+    SocketServer(uint16_t port, std::string certPath, std::string keyPath, std::string caPath, size_t threadCount = 1, threading mode = threading::pool)
+        : transportContext(Transport::make_context()), endpoint(tcp::v4(), port),
+          certPath(certPath), keyPath(keyPath), caPath(caPath), threadCount(threadCount > 0 ? threadCount : 1), mode(mode)
     {
-        this->ssl_context.set_options(
-            asio::ssl::context::default_workarounds 
-            | asio::ssl::context::no_sslv2
-            | asio::ssl::context::single_dh_use);
+        if constexpr (Transport::secure) {
+            this->transportContext.set_options(
+                asio::ssl::context::default_workarounds 
+                | asio::ssl::context::no_sslv2
+                | asio::ssl::context::single_dh_use);
+
+            /**
+            *   verify client auth
+            */
+            this->transportContext.set_verify_mode(asio::ssl::verify_peer | asio::ssl::verify_fail_if_no_peer_cert);
+            this->transportContext.load_verify_file(this->caPath);
 
-        /**
-        *   verify client auth
-        */
-        this->ssl_context.set_verify_mode(asio::ssl::verify_peer | asio::ssl::verify_fail_if_no_peer_cert);
-        this->ssl_context.load_verify_file(this->caPath);
+            this->transportContext.use_certificate_file(this->certPath, asio::ssl::context::pem);
+            this->transportContext.use_private_key_file(this->keyPath, asio::ssl::context::pem);
+
+            // Reconnecting clients resume their session instead of redoing the full handshake
+            this->tlsResumption = std::make_unique<tlsresumption>(this->transportContext, true);
+        }
 
-        this->ssl_context.use_certificate_file(this->certPath, asio::ssl::context::pem);
-        this->ssl_context.use_private_key_file(this->keyPath, asio::ssl::context::pem);
+        this->CreateShards();
+    }
+
+    // Create a server without TLS listening on endpoint, a port for tcp_transport or a path for local_transport and shm_transport
+    explicit SocketServer(const typename Transport::endpoint_type& endpoint, size_t threadCount = 1, threading mode = threading::pool)
+        : transportContext(Transport::make_context()), endpoint(endpoint), threadCount(threadCount > 0 ? threadCount : 1), mode(mode)
+    {
+        static_assert(!Transport::secure, "A TLS server needs its certificate, key and CA");
+        this->CreateShards();
     }
     
     virtual ~SocketServer() {
@@ -38,33 +99,656 @@ public:
     // Start the server
     bool Start() {
         try {   
-            this->WaitForConnection();
+            if (this->handshakeThreads > 0) {
+                this->handshakePool = std::make_unique<asio::thread_pool>(this->handshakeThreads);
+            }
+
+            for (auto& shard : this->shards) {
+                this->Listen(*shard);
+                this->WaitForConnection(*shard);
+            }
 
-            // Launch the asio context in its own thread
-            this->server_thread = std::thread([this]() { this->io_context.run(); });
+            // Launch the asio contexts, a pool shares its only shard while every shard gets its own thread
+            size_t threadsPerShard = this->mode == threading::sharded ? 1 : this->threadCount;
+            for (auto& shard : this->shards) {
+                for (size_t i = 0; i < threadsPerShard; i++) {
+                    Shard* pShard = shard.get();
+                    this->server_threads.emplace_back([pShard]() {
+                        bServerIoThread = true;
+                        pShard->io_context.run();
+                    });
+                }
+            }
         } catch (std::exception& e) {
             LOG(ERROR, "Exception", e.what());
             return false;
         }
 
-        LOG(INFO, "Started");
+        std::string layout = this->mode == threading::sharded ? " shard(s)" : " thread(s)";
+        LOG(INFO, "Started", std::to_string(this->threadCount) + layout);
         return true;
     };
 
     void Stop() {	
-        this->io_context.stop();
+        if (this->handshakePool) {
+            this->handshakePool->stop();
+            this->handshakePool->join();
+        }
 
-        if (this->server_thread.joinable()) this->server_thread.join();
-        if (this->request_thread.joinable()) this->request_thread.join();
+        if (this->workerPool) {
+            this->workerPool->stop();
+        }
+
+        for (auto& shard : this->shards) {
+            shard->io_context.stop();
+        }
+
+        for (auto& thread : this->server_threads) {
+            if (thread.joinable()) thread.join();
+        }
+        this->server_threads.clear();
+        for (auto& shard : this->shards) {
+            if (shard->request_thread.joinable()) shard->request_thread.join();
+        }
 
         LOG(INFO, "Stopped");
     }
 
     // ASYNC    
     void WaitForConnection() {
-        std::shared_ptr<SocketConnection<T>> conn = std::make_shared<SocketConnection<T>>(SocketConnection<T>::owner::server, this->io_context, this->ssl_context, this->qMessagesIn);
-        this->acceptor.async_accept(conn->socket(),
-            [this, conn](std::error_code err) {
+        for (auto& shard : this->shards) {
+            this->WaitForConnection(*shard);
+        }
+    }
+
+    // Limits applied to every connection accepted from now on
+    void SetOutboundLimits(const OutboundLimits& limits) {
+        this->outboundLimits = limits;
+    }
+
+    // Runs handler on the io thread as soon as a frame with id is parsed, instead of queueing it for the request thread
+    // Meant for echoes and plain relays, handler must not block since it holds up the io thread's other connections.
+    // Broadcasts it makes are never split across io threads, the io thread sends them itself without waiting on the others.
+    // It may overtake messages of the same connection that are still queued. Must be called before Start()
+    void SetInlineHandler(T id, typename SocketConnection<T, Transport>::inline_handler handler) {
+        this->inlineHandlers[(uint32_t)id] = std::move(handler);
+    }
+
+    // Broadcasts to more than clientsPerTask connections of a shard are split across its io threads
+    // 0 keeps every broadcast on the calling thread
+    void SetBroadcastFanout(size_t clientsPerTask) {
+        this->broadcastFanout = clientsPerTask;
+    }
+
+    // Frame limits applied to every connection accepted from now on
+    void SetInboundLimits(const InboundLimits& limits) {
+        this->inboundLimits = limits;
+    }
+
+    // Caps the memory held by queued messages and grown receive buffers across every connection and per connection, 0 is unbounded
+    // Connections stop reading while either cap is reached, the per connection cap applies to connections accepted from now on
+    void SetMemoryBudget(size_t totalBytes, size_t connectionBytes = 0) {
+        this->memoryBudget.set_limit(totalBytes);
+        this->connectionMemoryLimit = connectionBytes;
+    }
+
+    // Bytes currently held by queued messages and grown receive buffers, the most ever held and the limit
+    memorybudget::stats MemoryUsage() const {
+        return this->memoryBudget.Stats();
+    }
+
+    // Handshakes so far, how many were resumed and their CPU time
+    tlsresumption::stats TlsStats() const {
+        return this->tlsResumption ? this->tlsResumption->Stats() : tlsresumption::stats();
+    }
+
+    // Seals new session tickets with a fresh key, this also happens on its own every hour
+    void RotateTicketKeys() {
+        if (this->tlsResumption) {
+            this->tlsResumption->Rotate();
+        }
+    }
+
+    // Runs the TLS handshakes on threads of their own, so a reconnect storm doesn't hold up the io threads
+    // of established connections. At most maxConcurrent handshakes are in progress, 0 is unbounded
+    // Must be called before Start(), 0 threads keeps the handshakes on the io threads
+    void SetHandshakePool(size_t threads, size_t maxConcurrent = 0) {
+        this->handshakeThreads = threads;
+        this->maxConcurrentHandshakes = maxConcurrent;
+    }
+
+    // Closes connections whose handshake is not done within timeout, which frees their handshake slot
+    // 0 lets a stalled peer hold its slot for as long as it stays connected
+    void SetHandshakeTimeout(std::chrono::milliseconds timeout) {
+        this->handshakeTimeout = timeout;
+    }
+
+    HandshakeMetrics HandshakeStats() {
+        HandshakeMetrics metrics;
+        metrics.started = this->nHandshakesStarted.load(std::memory_order_relaxed);
+        metrics.completed = this->nHandshakesCompleted.load(std::memory_order_relaxed);
+        metrics.failed = this->nHandshakesFailed.load(std::memory_order_relaxed);
+        metrics.timedOut = this->nHandshakesTimedOut.load(std::memory_order_relaxed);
+        metrics.totalQueueNanos = this->nHandshakeQueueNanos.load(std::memory_order_relaxed);
+        metrics.maxQueueNanos = this->nMaxHandshakeQueueNanos.load(std::memory_order_relaxed);
+
+        std::scoped_lock lock(this->muxHandshakes);
+        metrics.inProgress = this->nHandshakesInProgress;
+        metrics.queued = this->deqPendingHandshakes.size();
+        return metrics;
+    }
+
+    // Connections beyond the handshake cap wait until a running handshake finishes
+    // Transports without a handshake have nothing to wait for and the connection goes straight to the data path
+    void ConnectToClient(std::shared_ptr<SocketConnection<T, Transport>> conn) {
+        if constexpr (Transport::handshake) {
+            std::chrono::steady_clock::time_point accepted = std::chrono::steady_clock::now();
+            {
+                std::scoped_lock lock(this->muxHandshakes);
+                if (this->maxConcurrentHandshakes > 0 && this->nHandshakesInProgress >= this->maxConcurrentHandshakes) {
+                    this->deqPendingHandshakes.push_back({ conn, accepted });
+                    return;
+                }
+                this->nHandshakesInProgress++;
+            }
+
+            this->Handshake(conn, accepted);
+        } else {
+            this->Approve(conn);
+        }
+    }
+
+    void MessageClient(std::shared_ptr<SocketConnection<T, Transport>> client, const Message<T>& msg) {
+        if (client && client->IsConnected()) {
+            client->Send(msg);
+        } else {
+            this->OnClientDisconnect(client);
+
+            this->removeConnection(client);
+        }
+    }
+
+    // Walks a snapshot of every shard's connections, accepts and disconnects don't wait for the broadcast
+    // Large broadcasts are split into one task per io thread that walks its share of the shard's connections,
+    // the caller works through every share no io thread has picked up yet and returns once all of them are done.
+    // Everything is posted by then, so a client still receives messages in the order they were sent.
+    // Called on an io thread, from an inline handler, the io thread sends to every share itself
+    void MessageAllClients(const Message<T>& msg, std::shared_ptr<SocketConnection<T, Transport>> pIgnoreClient = nullptr) {
+        std::vector<std::pair<Shard*, Recipients>> recipients;
+        for (auto& shard : this->shards) {
+            recipients.push_back({ shard.get(), this->Snapshot(*shard) });
+        }
+        this->Fanout(msg, pIgnoreClient, recipients);
+    }
+
+    // Sends msg to the clients subscribed to its id, clients that never subscribed to anything receive every message
+    // Only collecting the subscribers holds the shard lock, they are sent to like a broadcast
+    void MessageSubscribers(const Message<T>& msg, std::shared_ptr<SocketConnection<T, Transport>> pIgnoreClient = nullptr) {
+        std::vector<std::pair<Shard*, Recipients>> recipients;
+        for (auto& shard : this->shards) {
+            auto clients = std::make_shared<std::vector<std::shared_ptr<SocketConnection<T, Transport>>>>();
+            {
+                std::scoped_lock lock(shard->muxConnections);
+                shard->subscriptions.for_each(msg.header.id, [&](const std::shared_ptr<SocketConnection<T, Transport>>& client) {
+                    clients->push_back(client);
+                });
+            }
+            recipients.push_back({ shard.get(), std::move(clients) });
+        }
+        this->Fanout(msg, pIgnoreClient, recipients);
+    }
+
+    // Sends msg to every client that said hello as type, without walking the other connections
+    void MessageGroup(ClientType type, const Message<T>& msg, std::shared_ptr<SocketConnection<T, Transport>> pIgnoreClient = nullptr) {
+        std::vector<std::pair<Shard*, Recipients>> recipients;
+        for (auto& shard : this->shards) {
+            auto clients = std::make_shared<std::vector<std::shared_ptr<SocketConnection<T, Transport>>>>();
+            {
+                std::scoped_lock lock(shard->muxConnections);
+                shard->groups.for_each(type, [&](const std::shared_ptr<SocketConnection<T, Transport>>& client) {
+                    clients->push_back(client);
+                });
+            }
+            recipients.push_back({ shard.get(), std::move(clients) });
+        }
+        this->Fanout(msg, pIgnoreClient, recipients);
+    }
+
+    // Sends msg to the client that said hello with deviceId, returns false if that device isn't connected
+    bool MessageDevice(uint64_t deviceId, const Message<T>& msg) {
+        std::shared_ptr<SocketConnection<T, Transport>> client = this->Device(deviceId);
+        if (!client) {
+            return false;
+        }
+
+        client->Send(msg);
+        return true;
+    }
+
+    // Sends msg to every connected device in deviceIds, a single lookup per target
+    // Returns how many of them were reached
+    size_t MessageDevices(const std::vector<uint64_t>& deviceIds, const Message<T>& msg) {
+        size_t reached = 0;
+        for (uint64_t deviceId : deviceIds) {
+            if (this->MessageDevice(deviceId, msg)) {
+                reached++;
+            }
+        }
+        return reached;
+    }
+
+    // The connection of deviceId, nullptr if it isn't connected
+    std::shared_ptr<SocketConnection<T, Transport>> Device(uint64_t deviceId) {
+        std::scoped_lock lock(this->muxDevices);
+        auto device = this->devices.find(deviceId);
+        if (device == this->devices.end()) {
+            return nullptr;
+        }
+
+        if (!device->second->IsConnected()) {
+            this->devices.erase(device);
+            return nullptr;
+        }
+        return device->second;
+    }
+
+    // Number of connected clients that said hello as type
+    size_t GroupSize(ClientType type) {
+        size_t size = 0;
+        for (auto& shard : this->shards) {
+            std::scoped_lock lock(shard->muxConnections);
+            size += shard->groups.count(type);
+        }
+        return size;
+    }
+
+    // Wire features this server supports, a client gets the ones it announced as well, must be called before Start()
+    void SetCapabilities(uint32_t capabilities) {
+        this->capabilities = capabilities;
+    }
+
+    // Subscribing switches client from every message to only the ids it subscribed to
+    // Subscriptions are counted, an id is dropped once it has been unsubscribed as often as it was subscribed
+    void Subscribe(std::shared_ptr<SocketConnection<T, Transport>> client, T id) {
+        Shard& shard = this->ShardOf(client);
+        std::scoped_lock lock(shard.muxConnections);
+        // A client that disconnected while its request was queued is already out of the index and stays out
+        if (shard.subscriptions.contains(client)) {
+            shard.subscriptions.subscribe(client, id);
+        }
+    }
+
+    void Unsubscribe(std::shared_ptr<SocketConnection<T, Transport>> client, T id) {
+        Shard& shard = this->ShardOf(client);
+        std::scoped_lock lock(shard.muxConnections);
+        shard.subscriptions.unsubscribe(client, id);
+    }
+
+    // Names a group of ids clients can subscribe to at once, must be called before Start()
+    void DefineCategory(uint32_t category, const std::vector<T>& ids) {
+        this->categories[category] = ids;
+    }
+
+    void SubscribeCategory(std::shared_ptr<SocketConnection<T, Transport>> client, uint32_t category) {
+        auto ids = this->categories.find(category);
+        if (ids == this->categories.end()) {
+            return;
+        }
+
+        Shard& shard = this->ShardOf(client);
+        std::scoped_lock lock(shard.muxConnections);
+        if (shard.subscriptions.contains(client)) {
+            for (const T& id : ids->second) {
+                shard.subscriptions.subscribe(client, id);
+            }
+        }
+    }
+
+    void UnsubscribeCategory(std::shared_ptr<SocketConnection<T, Transport>> client, uint32_t category) {
+        auto ids = this->categories.find(category);
+        if (ids == this->categories.end()) {
+            return;
+        }
+
+        Shard& shard = this->ShardOf(client);
+        std::scoped_lock lock(shard.muxConnections);
+        for (const T& id : ids->second) {
+            shard.subscriptions.unsubscribe(client, id);
+        }
+    }
+
+    // Key of a message that may be handled on any worker in any order, see RequestKey
+    static constexpr size_t UNORDERED_KEY = SIZE_MAX;
+
+    // Runs the handlers on workers instead of the request threads, so a slow handler only holds up its own key
+    // Messages with the same key, by default those of one connection, are handled one after the other in order
+    // A worker queues up to queuedPerWorker messages, past that the request thread waits and the inbound queue pauses reads
+    // Must be called before HandleRequests(), 0 keeps the handlers on the request threads
+    void SetRequestWorkers(size_t workers, size_t queuedPerWorker = workerpool<Request>::DEFAULT_CAPACITY) {
+        this->requestWorkers = workers;
+        this->requestWorkerCapacity = queuedPerWorker;
+    }
+
+    // Queue depth, handled and stolen messages and time in queue of every worker, empty without workers
+    std::vector<workerstats> WorkerStats() const {
+        return this->workerPool ? this->workerPool->Stats() : std::vector<workerstats>();
+    }
+
+    // Every shard's inbound queue is drained by its own request thread
+    void HandleRequests() {
+        this->StartWorkers();
+        for (auto& shard : this->shards) {
+            this->HandleShardRequests(*shard);
+        }
+    }
+
+    // Drains the first shard on the calling thread, any other shard is handed its own request thread
+    void HandleRequestsNoThread() {
+        if (!this->requestThreadsStarted) {
+            this->requestThreadsStarted = true;
+            this->StartWorkers();
+            for (size_t i = 1; i < this->shards.size(); i++) {
+                this->HandleShardRequests(*this->shards[i]);
+            }
+        }
+
+        Shard& shard = *this->shards.front();
+        shard.qMessagesIn.wait();
+        shard.qMessagesIn.drain([this, &shard](OwnedMessage<T, Transport>& ownedMessage) {
+            this->Dispatch(shard, ownedMessage);
+        });
+    }
+
+    void removeConnection(std::shared_ptr<SocketConnection<T, Transport>> conn) {
+        if (!conn) {
+            return;
+        }
+
+        Shard& shard = this->ShardOf(conn);
+        std::scoped_lock lock(shard.muxConnections);
+        this->Retire(shard, conn);
+    }
+
+    // Called by conn once its read loop has ended, nothing it sent is queued after this
+    // Its slot is freed when the request thread gets to the marker queued behind its last message
+    void connectionClosed(std::shared_ptr<SocketConnection<T, Transport>> conn) {
+        Shard& shard = this->ShardOf(conn);
+        {
+            std::scoped_lock lock(shard.muxConnections);
+            this->Retire(shard, conn);
+        }
+
+        // Pushed without the lock, the request thread takes it to erase the slot
+        this->PushClosed(shard, conn->Handle());
+    }
+
+protected:
+    // Server class should override these functions
+    virtual bool OnClientConnect(std::shared_ptr<SocketConnection<T, Transport> > client) {
+        return false;
+    }
+
+    virtual void OnClientDisconnect(std::shared_ptr<SocketConnection<T, Transport> > client) {
+
+    }
+
+    virtual void OnMessageRecieved(std::shared_ptr<SocketConnection<T, Transport> > client, Message<T>& msg) {
+
+    }
+
+    // Called for a message the client addressed to devices with Address(), msg is the message it carries
+    virtual void OnAddressedMessageRecieved(std::shared_ptr<SocketConnection<T, Transport> > client, Message<T>& msg, const std::vector<uint64_t>& targets) {
+
+    }
+
+    // Called once the client's hello is handled, client->Capabilities() holds what was negotiated
+    virtual void OnClientHello(std::shared_ptr<SocketConnection<T, Transport> > client, const Hello& hello) {
+
+    }
+
+    // Called for every piece of a body above InboundLimits::streamThreshold, in order
+    // msg.header.size is the size of the whole body, msg.body the bytes starting at offset
+    virtual void OnMessageChunkRecieved(std::shared_ptr<SocketConnection<T, Transport> > client, Message<T>& msg, uint32_t offset, bool last) {
+
+    }
+
+    // Called on the client's io thread when its outbound queue crosses the high watermark (congested)
+    // and again once it has drained below the low watermark
+    virtual void OnClientCongestion(std::shared_ptr<SocketConnection<T, Transport> > client, bool congested) {
+
+    }
+
+    virtual void OnClientValidated() {
+
+    }
+
+    // Picks the worker that handles msg once SetRequestWorkers is used, messages with the same key are handled in order
+    // UNORDERED_KEY lets any idle worker take msg. Hellos and streamed chunks always stay with their connection
+    virtual size_t RequestKey(std::shared_ptr<SocketConnection<T, Transport> > client, const Message<T>& msg) {
+        return std::hash<SocketConnection<T, Transport>*>()(client.get());
+    }
+
+protected:
+    /**
+     * A shard owns everything the accept, handshake and read paths touch so that
+     * no two io threads contend over the same data. In pool mode there is exactly one shard.
+     */
+    struct Shard {
+        asio::io_context io_context;
+        typename Transport::protocol_type::acceptor acceptor { io_context };
+
+        // Lock free queue for incoming messages, every io thread of the shard produces and its request thread consumes
+        mpscqueue<OwnedMessage<T, Transport> > qMessagesIn;
+
+        struct Registration {
+            std::shared_ptr<SocketConnection<T, Transport>> connection;
+            // Out of broadcasts and indexes, but the request thread hasn't reached the connection's last message yet
+            bool retired = false;
+        };
+
+        // Approved connections, a removed one keeps its slot until every message it sent is handled
+        // so the handles in the inbound queue always find it
+        slotmap<Registration> connections;
+
+        // The connections that aren't retired, broadcasts walk it without holding muxConnections
+        // Rebuilt on the first broadcast after a change, a broadcast in progress keeps the one it took
+        std::shared_ptr<const std::vector<std::shared_ptr<SocketConnection<T, Transport>>>> snapshot;
+        bool bSnapshotStale = true;
+
+        // Which of the connections receive which message ids
+        subscriptionindex<T, std::shared_ptr<SocketConnection<T, Transport>>> subscriptions;
+
+        // Connections by the type they said hello as, each one subscribes to its type only
+        subscriptionindex<ClientType, std::shared_ptr<SocketConnection<T, Transport>>> groups;
+
+        // Guards connections, snapshot, subscriptions and groups, they are touched by the io threads and the request thread
+        std::mutex muxConnections;
+
+        std::thread request_thread;
+
+        // Recycled storage for the accept handlers and the work posted to the shard
+        handler_memory handlerMemory;
+    };
+
+    // Declared before the shards so it outlives every connection they still hold when the server is destroyed
+    memorybudget memoryBudget;
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+private:
+    // A message handed to a worker, it holds the connection until it is handled
+    struct Request {
+        std::shared_ptr<SocketConnection<T, Transport>> remote;
+        OwnedMessage<T, Transport> ownedMessage;
+    };
+
+    // Connections a message goes to, shared with the io thread tasks that send it
+    typedef std::shared_ptr<const std::vector<std::shared_ptr<SocketConnection<T, Transport>>>> Recipients;
+
+    /**
+     * One broadcast, shared by the caller and the io thread tasks it posted.
+     * Every part is run exactly once by whoever claims it first, the message itself is shared
+     * by every Send since copying it only shares its body.
+     */
+    struct Broadcast {
+        struct Part {
+            Shard* shard;
+            Recipients clients;
+            size_t begin;
+            size_t end;
+            // Only touched by whoever runs the part, the caller reads it once every part is done
+            std::vector<std::shared_ptr<SocketConnection<T, Transport>>> disconnected;
+        };
+
+        Message<T> msg;
+        std::shared_ptr<SocketConnection<T, Transport>> pIgnoreClient;
+
+        std::vector<Part> parts;
+        std::unique_ptr<std::atomic<bool>[]> claimed;
+
+        size_t nDone = 0;
+        std::mutex muxDone;
+        std::condition_variable cvDone;
+
+        Broadcast(const Message<T>& msg, std::shared_ptr<SocketConnection<T, Transport>> pIgnoreClient)
+            : msg(msg), pIgnoreClient(pIgnoreClient) {}
+
+        // Does nothing if the part was already claimed
+        void run(size_t i) {
+            if (this->claimed[i].exchange(true)) {
+                return;
+            }
+
+            Part& part = this->parts[i];
+            for (size_t c = part.begin; c < part.end; c++) {
+                const std::shared_ptr<SocketConnection<T, Transport>>& client = (*part.clients)[c];
+                // Make sure the client is connected
+                if (client->IsConnected()) {
+                    if (client != this->pIgnoreClient) {
+                        client->Send(this->msg);
+                    }
+                } else {
+                    part.disconnected.push_back(client);
+                }
+            }
+
+            {
+                std::scoped_lock lock(this->muxDone);
+                this->nDone++;
+            }
+            this->cvDone.notify_all();
+        }
+
+        // Waits for the parts io threads are still running
+        void wait() {
+            std::unique_lock lock(this->muxDone);
+            this->cvDone.wait(lock, [this]() { return this->nDone == this->parts.size(); });
+        }
+    };
+
+    // Sends msg to the recipients of every shard, see MessageAllClients
+    void Fanout(const Message<T>& msg, std::shared_ptr<SocketConnection<T, Transport>> pIgnoreClient, const std::vector<std::pair<Shard*, Recipients>>& recipients) {
+        std::shared_ptr<Broadcast> broadcast = std::make_shared<Broadcast>(msg, pIgnoreClient);
+
+        // An io thread waiting on the others could wait on one that waits on it, so it sends every part itself
+        bool onIoThread = bServerIoThread;
+        size_t threadsPerShard = this->mode == threading::sharded ? 1 : this->threadCount;
+        for (auto& [shard, clients] : recipients) {
+            if (clients->empty()) {
+                continue;
+            }
+
+            size_t tasks = 1;
+            if (this->broadcastFanout > 0 && !onIoThread) {
+                tasks = std::min(threadsPerShard, (clients->size() + this->broadcastFanout - 1) / this->broadcastFanout);
+            }
+
+            size_t share = (clients->size() + tasks - 1) / tasks;
+            for (size_t begin = 0; begin < clients->size(); begin += share) {
+                broadcast->parts.push_back({ shard, clients, begin, std::min(begin + share, clients->size()), {} });
+            }
+        }
+
+        broadcast->claimed = std::make_unique<std::atomic<bool>[]>(broadcast->parts.size());
+        if (broadcast->parts.size() > 1 && !onIoThread) {
+            for (size_t i = 0; i < broadcast->parts.size(); i++) {
+                Shard* shard = broadcast->parts[i].shard;
+                asio::post(shard->io_context, make_custom_alloc_handler(shard->handlerMemory, [broadcast, i]() {
+                    broadcast->run(i);
+                }));
+            }
+        }
+
+        for (size_t i = 0; i < broadcast->parts.size(); i++) {
+            broadcast->run(i);
+        }
+        broadcast->wait();
+
+        // This client shouldn't be contacted, so assume it has been disconnected
+        for (auto& part : broadcast->parts) {
+            for (auto& client : part.disconnected) {
+                bool retired;
+                {
+                    std::scoped_lock lock(part.shard->muxConnections);
+                    retired = this->Retire(*part.shard, client);
+                }
+                if (retired) {
+                    this->OnClientDisconnect(client);
+                }
+            }
+        }
+    }
+
+    void CreateShards() {
+        size_t shardCount = this->mode == threading::sharded ? this->threadCount : 1;
+        for (size_t i = 0; i < shardCount; i++) {
+            this->shards.push_back(std::make_unique<Shard>());
+        }
+    }
+
+    // Opens the shard's acceptor, shards share the port through SO_REUSEPORT and the kernel balances between them
+    void Listen(Shard& shard) {
+        if (&shard == this->shards.front().get()) {
+            Transport::prepare_bind(this->endpoint);
+        }
+
+        shard.acceptor.open(this->endpoint.protocol());
+        shard.acceptor.set_option(typename Transport::protocol_type::acceptor::reuse_address(true));
+
+        if (this->mode == threading::sharded) {
+            if (!Transport::shardable) {
+                throw std::runtime_error("Sharded mode isn't supported by this transport");
+            }
+#if defined(SO_REUSEPORT)
+            shard.acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+            throw std::runtime_error("Sharded mode requires SO_REUSEPORT");
+#endif
+        }
+
+        shard.acceptor.bind(this->endpoint);
+        shard.acceptor.listen();
+    }
+
+    // ASYNC
+    void WaitForConnection(Shard& shard) {
+        std::shared_ptr<SocketConnection<T, Transport>> conn = std::make_shared<SocketConnection<T, Transport>>(SocketConnection<T, Transport>::owner::server, shard.io_context, this->transportContext, shard.qMessagesIn, &this->memoryBudget);
+        conn->SetOutboundLimits(this->outboundLimits);
+        conn->SetInboundLimits(this->inboundLimits);
+        conn->SetMemoryLimit(this->connectionMemoryLimit);
+        if (!this->inlineHandlers.empty()) {
+            conn->SetInlineHandlers(&this->inlineHandlers);
+        }
+
+        std::weak_ptr<SocketConnection<T, Transport>> weakConn = conn;
+        conn->SetWatermarkHandler([this, weakConn](bool congested) {
+            if (auto client = weakConn.lock()) {
+                LOG(INFO, congested ? "Client is congested" : "Client is no longer congested", client->RemoteEndpoint());
+                this->OnClientCongestion(client, congested);
+            }
+        });
+        shard.acceptor.async_accept(conn->socket(), make_custom_alloc_handler(shard.handlerMemory,
+            [this, &shard, conn](std::error_code err) {
                 // Triggered by incoming SocketConnection request
                 LOG(DEBUG, "Recieved new connection");
                 if (!err) {
@@ -72,7 +756,7 @@ public:
                     LOG(INFO, "New Connection", conn->socket().remote_endpoint());
 
                     if (this->OnClientConnect(conn)) {                
-                        this->deqConnections.push_back(std::move(conn));
+                        // The connection joins the shard's connections once its handshake is done
                         this->ConnectToClient(conn);
                     } else {
                         LOG(INFO, "Connection denied", conn->socket().remote_endpoint());
@@ -81,115 +765,318 @@ public:
                     }
                 }
                 else {
-                    LOG(ERROR, "New Connection Error",  conn->socket().remote_endpoint(), err.message());
+                    LOG(ERROR, "New Connection Error",  conn->RemoteEndpoint(), err.message());
                 }
                 LOG(DEBUG, "Done with new conneciton, Waiting for a new one...");
                 // Prime the asio context with more work - again simply wait for
                 // another SocketConnection...
-                this->WaitForConnection();
-        });
+                this->WaitForConnection(shard);
+        }));
     };
 
-    void ConnectToClient(std::shared_ptr<SocketConnection<T>> conn) {
-         conn->ssl_socket_stream().async_handshake(asio::ssl::stream_base::server,
-            [this, conn](const std::error_code err) {
+    // The caller holds one of the handshake slots, it is handed on to the next queued connection afterwards
+    void Handshake(std::shared_ptr<SocketConnection<T, Transport>> conn, std::chrono::steady_clock::time_point accepted) {
+        uint64_t queueNanos = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - accepted).count();
+        this->nHandshakesStarted.fetch_add(1, std::memory_order_relaxed);
+        this->nHandshakeQueueNanos.fetch_add(queueNanos, std::memory_order_relaxed);
+        uint64_t maxQueueNanos = this->nMaxHandshakeQueueNanos.load(std::memory_order_relaxed);
+        while (queueNanos > maxQueueNanos && !this->nMaxHandshakeQueueNanos.compare_exchange_weak(maxQueueNanos, queueNanos, std::memory_order_relaxed)) {}
+
+        // The deadline and the handshake's completions share a strand, so closing the socket never races a step of the handshake
+        // The socket still belongs to the shard's io_context, only the handshake's completions and crypto run on the pool
+        asio::any_io_executor executor = conn->stream().get_executor();
+        if (this->handshakePool) {
+            executor = asio::make_strand(this->handshakePool->get_executor());
+        }
+
+        std::shared_ptr<asio::steady_timer> deadline;
+        if (this->handshakeTimeout.count() > 0) {
+            deadline = std::make_shared<asio::steady_timer>(executor, this->handshakeTimeout);
+        }
+
+        auto handler = conn->Recycled([this, conn, deadline](const std::error_code err) {
+            if (deadline) {
+                deadline->cancel();
+            }
+
+            if (!err) {
+                this->nHandshakesCompleted.fetch_add(1, std::memory_order_relaxed);
+                this->Approve(conn);
+            } else {
+                this->nHandshakesFailed.fetch_add(1, std::memory_order_relaxed);
+                LOG(ERROR, "Handshake error", conn->RemoteEndpoint(), err.message());
+            }
+
+            this->NextHandshake();
+        });
+
+        conn->stream().async_handshake(asio::ssl::stream_base::server, asio::bind_executor(executor, std::move(handler)));
+
+        // Closing the socket fails the handshake, whose handler then hands the slot on
+        if (deadline) {
+            deadline->async_wait(conn->Recycled([this, conn](const std::error_code err) {
                 if (!err) {
-                    LOG(INFO, "Connection approved", conn->socket().remote_endpoint());
-                    conn->ReadHeaderFromClient(this, conn);
-                } else {
-                    LOG(ERROR, "Handshake error", conn->socket().remote_endpoint(), err.message());
+                    this->nHandshakesTimedOut.fetch_add(1, std::memory_order_relaxed);
+                    LOG(ERROR, "Handshake timed out -- closing socket", conn->RemoteEndpoint());
+                    std::error_code ignored;
+                    conn->socket().close(ignored);
                 }
+            }));
+        }
+    }
+
+    // Back to the data path, from here on the connection is only touched from its strand
+    void Approve(std::shared_ptr<SocketConnection<T, Transport>> conn) {
+        conn->Post([this, conn]() {
+            LOG(INFO, "Connection approved", conn->RemoteEndpoint());
+            {
+                Shard& shard = this->ShardOf(conn);
+                std::scoped_lock lock(shard.muxConnections);
+                conn->SetHandle(shard.connections.insert({ conn }));
+                shard.bSnapshotStale = true;
+                shard.subscriptions.add(conn);
             }
-        );
+            conn->ReadHeaderFromClient(this, conn);
+        });
     }
 
-    void MessageClient(std::shared_ptr<SocketConnection<T>> client, const Message<T>& msg) {
-        if (client && client->IsConnected()) {
-            client->Send(msg);
-        } else {
-            this->OnClientDisconnect(client);
+    void NextHandshake() {
+        std::pair<std::shared_ptr<SocketConnection<T, Transport>>, std::chrono::steady_clock::time_point> next;
+        {
+            std::scoped_lock lock(this->muxHandshakes);
+            if (this->deqPendingHandshakes.empty()) {
+                this->nHandshakesInProgress--;
+                return;
+            }
+            next = std::move(this->deqPendingHandshakes.front());
+            this->deqPendingHandshakes.pop_front();
+        }
 
-            client.reset();
+        this->Handshake(next.first, next.second);
+    }
 
-            this->deqConnections.erase(std::remove(this->deqConnections.begin(), this->deqConnections.end(), client), this->deqConnections.end());
+    void StartWorkers() {
+        if (this->requestWorkers > 0 && !this->workerPool) {
+            this->workerPool = std::make_unique<workerpool<Request>>(this->requestWorkers, [this](Request& request) {
+                this->Handle(request.remote, request.ownedMessage);
+            }, this->requestWorkerCapacity);
         }
     }
 
-    void MessageAllClients(const Message<T>& msg, std::shared_ptr<SocketConnection<T>> pIgnoreClient = nullptr) {
-        for (auto& client : this->deqConnections) {
-            // Make sure the client is connected
-            if (client && client->IsConnected()) {
-                if (client != pIgnoreClient) {
-                    client->Send(msg);
-                }
+    void HandleShardRequests(Shard& shard) {
+        shard.request_thread = std::thread([this, &shard]() { 
+            while (true) {
+                shard.qMessagesIn.wait();
+                shard.qMessagesIn.drain([this, &shard](OwnedMessage<T, Transport>& ownedMessage) {
+                    this->Dispatch(shard, ownedMessage);
+                });
+            }
+        });    
+    }
+
+    void Dispatch(Shard& shard, OwnedMessage<T, Transport>& ownedMessage) {
+        std::shared_ptr<SocketConnection<T, Transport>> remote;
+        {
+            std::scoped_lock lock(shard.muxConnections);
+            typename Shard::Registration* registration = shard.connections.find(ownedMessage.remote);
+            if (!registration) {
+                return;
+            }
+
+            remote = registration->connection;
+            if (ownedMessage.closed) {
+                // The connection may be destroyed with remote, outside of the lock
+                shard.connections.erase(ownedMessage.remote);
+                return;
+            }
+        }
+
+        if (this->workerPool) {
+            size_t key;
+            uint32_t id = (uint32_t)ownedMessage.message.header.id;
+            if (ownedMessage.chunk.streamed || id == HELLO_FRAME_ID) {
+                key = std::hash<SocketConnection<T, Transport>*>()(remote.get());
             } else {
-                // This client shouldn't be contacted, so assume it has been disconnected
-                OnClientDisconnect(client);
-                client.reset();
+                key = this->RequestKey(remote, ownedMessage.message);
             }
+            this->workerPool->push(key, { remote, std::move(ownedMessage) });
+            return;
         }
+
+        this->Handle(remote, ownedMessage);
     }
 
-    void HandleRequests() {
-        this->request_thread = std::thread([this]() { 
-            while (true) {
-                this->qMessagesIn.wait();
-                while (!this->qMessagesIn.empty()) {
-                    auto ownedMessage = this->qMessagesIn.pop_front();
+    // Runs the handler of a message whose connection is resolved, on the request thread or a worker
+    void Handle(std::shared_ptr<SocketConnection<T, Transport>> remote, OwnedMessage<T, Transport>& ownedMessage) {
+        // The handler may consume the body, so take its size beforehand
+        size_t bytes = sizeof(MessageHeader<T>) + ownedMessage.message.body.size();
 
-                    this->OnMessageRecieved(ownedMessage.remote, ownedMessage.message);
-                }
+        uint32_t id = (uint32_t)ownedMessage.message.header.id;
+        if (ownedMessage.chunk.streamed) {
+            this->OnMessageChunkRecieved(remote, ownedMessage.message, ownedMessage.chunk.offset, ownedMessage.chunk.last);
+        } else if (id == HELLO_FRAME_ID) {
+            this->Greet(remote);
+        } else if (id == ROUTED_FRAME_ID) {
+            std::vector<uint64_t> targets;
+            if (Unaddress(ownedMessage.message, targets)) {
+                this->OnAddressedMessageRecieved(remote, ownedMessage.message, targets);
             }
-        });    
+        } else {
+            this->OnMessageRecieved(remote, ownedMessage.message);
+        }
+
+        remote->ReleaseInbound(bytes);
     }
 
-    void HandleRequestsNoThread() {
-        this->qMessagesIn.wait();
-        while (!this->qMessagesIn.empty()) {
-            auto ownedMessage = this->qMessagesIn.pop_front();
+    // Files the client under its type and answers with the capabilities both sides support
+    void Greet(std::shared_ptr<SocketConnection<T, Transport>> client) {
+        Hello hello = client->PeerHello();
+        client->Negotiate(hello.capabilities & this->capabilities);
+        {
+            Shard& shard = this->ShardOf(client);
+            std::scoped_lock lock(shard.muxConnections);
+            // A client that disconnected while its hello was queued is already gone from the shard
+            if (!shard.subscriptions.contains(client)) {
+                return;
+            }
+            shard.groups.subscribe(client, hello.type);
+        }
 
-            this->OnMessageRecieved(ownedMessage.remote, ownedMessage.message);
+        // A device that reconnects before its old connection is noticed as gone takes over its id
+        if (hello.deviceId != 0) {
+            std::scoped_lock lock(this->muxDevices);
+            this->devices[hello.deviceId] = client;
         }
-    }
 
-    void removeConnection(std::shared_ptr<SocketConnection<T>> conn) {
-        this->deqConnections.erase(std::remove(this->deqConnections.begin(), this->deqConnections.end(), conn), this->deqConnections.end());
-    }
+        Hello answer;
+        answer.type = hello.type;
+        answer.capabilities = client->Capabilities();
+        client->Send(SocketConnection<T, Transport>::MakeHello(answer));
 
-protected:
-    // Server class should override these functions
-    virtual bool OnClientConnect(std::shared_ptr<SocketConnection<T> > client) {
-        return false;
+        this->OnClientHello(client, hello);
     }
 
-    virtual void OnClientDisconnect(std::shared_ptr<SocketConnection<T> > client) {
+    // Takes client out of broadcasts, subscriptions, groups and the device index, muxConnections must be held
+    // It keeps its slot until connectionClosed, messages it already queued still reach the handlers
+    bool Retire(Shard& shard, const std::shared_ptr<SocketConnection<T, Transport>>& client) {
+        typename Shard::Registration* registration = shard.connections.find(client->Handle());
+        if (!registration || registration->retired) {
+            return false;
+        }
 
+        registration->retired = true;
+        shard.bSnapshotStale = true;
+        shard.subscriptions.remove(client);
+        shard.groups.remove(client);
+        this->ForgetDevice(client);
+        return true;
     }
 
-    virtual void OnMessageRecieved(std::shared_ptr<SocketConnection<T> > client, Message<T>& msg) {
+    // Queues the closed marker of handle, a full queue retries on the shard's io_context once the request thread made room
+    void PushClosed(Shard& shard, slothandle handle) {
+        OwnedMessage<T, Transport> marker;
+        marker.remote = handle;
+        marker.closed = true;
+        if (!shard.qMessagesIn.try_push(std::move(marker))) {
+            shard.qMessagesIn.wait_for_space([this, &shard, handle]() {
+                asio::post(shard.io_context, make_custom_alloc_handler(shard.handlerMemory, [this, &shard, handle]() { this->PushClosed(shard, handle); }));
+            });
+        }
+    }
 
+    // The shard's live connections as of now, muxConnections must not be held
+    Recipients Snapshot(Shard& shard) {
+        std::scoped_lock lock(shard.muxConnections);
+        if (shard.bSnapshotStale) {
+            auto clients = std::make_shared<std::vector<std::shared_ptr<SocketConnection<T, Transport>>>>();
+            clients->reserve(shard.connections.size());
+            for (auto& registration : shard.connections) {
+                if (!registration.retired) {
+                    clients->push_back(registration.connection);
+                }
+            }
+            shard.snapshot = std::move(clients);
+            shard.bSnapshotStale = false;
+        }
+        return shard.snapshot;
     }
 
-    virtual void OnClientValidated() {
+    // Drops client from the device index unless its id already belongs to a newer connection
+    void ForgetDevice(const std::shared_ptr<SocketConnection<T, Transport>>& client) {
+        uint64_t deviceId = client->PeerHello().deviceId;
+        if (deviceId == 0) {
+            return;
+        }
 
+        std::scoped_lock lock(this->muxDevices);
+        auto device = this->devices.find(deviceId);
+        if (device != this->devices.end() && device->second == client) {
+            this->devices.erase(device);
+        }
     }
 
-protected:
-    // Thread safe queue for incoming messages
-    tsqueue<OwnedMessage<T> > qMessagesIn;
-
-    // Container of active validated connections
-    std::deque<std::shared_ptr<SocketConnection<T>>> deqConnections;   
+    // A connection lives on the shard whose io_context it was created with
+    Shard& ShardOf(const std::shared_ptr<SocketConnection<T, Transport>>& conn) {
+        for (auto& shard : this->shards) {
+            if (&shard->io_context == &conn->context()) {
+                return *shard;
+            }
+        }
+        return *this->shards.front();
+    }
 
 private:
-    asio::io_context io_context;
-    asio::ip::tcp::acceptor acceptor;
-    asio::ssl::context ssl_context;
+    typename Transport::context_type transportContext;
+    std::unique_ptr<tlsresumption> tlsResumption;
 
-    std::thread server_thread;
-    std::thread request_thread;
+    std::vector<std::thread> server_threads;
+    bool requestThreadsStarted = false;
+
+    typename Transport::endpoint_type endpoint;
 
     std::string certPath;
     std::string keyPath;
     std::string caPath;
+
+    size_t threadCount;
+    threading mode;
+
+    uint32_t capabilities = 0;
+
+    // Connections by the device id they said hello with, across every shard
+    // Taken after a shard's muxConnections when both are needed, never the other way around
+    std::unordered_map<uint64_t, std::shared_ptr<SocketConnection<T, Transport>>> devices;
+    std::mutex muxDevices;
+
+    std::unordered_map<uint32_t, typename SocketConnection<T, Transport>::inline_handler> inlineHandlers;
+
+    // Ids clients subscribe to at once by category
+    std::unordered_map<uint32_t, std::vector<T>> categories;
+
+    OutboundLimits outboundLimits;
+    InboundLimits inboundLimits;
+    size_t connectionMemoryLimit = 0;
+
+    size_t broadcastFanout = 256;
+
+    size_t requestWorkers = 0;
+    size_t requestWorkerCapacity = workerpool<Request>::DEFAULT_CAPACITY;
+    std::unique_ptr<workerpool<Request>> workerPool;
+
+    size_t handshakeThreads = 0;
+    size_t maxConcurrentHandshakes = 0;
+    std::chrono::milliseconds handshakeTimeout { 10000 };
+    std::unique_ptr<asio::thread_pool> handshakePool;
+
+    // Accepted connections waiting for a handshake slot and the number of slots taken, both under muxHandshakes
+    std::deque<std::pair<std::shared_ptr<SocketConnection<T, Transport>>, std::chrono::steady_clock::time_point>> deqPendingHandshakes;
+    size_t nHandshakesInProgress = 0;
+    std::mutex muxHandshakes;
+
+    std::atomic<uint64_t> nHandshakesStarted { 0 };
+    std::atomic<uint64_t> nHandshakesCompleted { 0 };
+    std::atomic<uint64_t> nHandshakesFailed { 0 };
+    std::atomic<uint64_t> nHandshakesTimedOut { 0 };
+    std::atomic<uint64_t> nHandshakeQueueNanos { 0 };
+    std::atomic<uint64_t> nMaxHandshakeQueueNanos { 0 };
 };
\ No newline at end of file
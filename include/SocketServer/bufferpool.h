@@ -0,0 +1,241 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/**
+ * Size class pool for message body storage
+ *
+ * Requests are rounded up to a power of two size class between 64 bytes and 64 KiB. Every
+ * thread keeps a small cache of free blocks per class, so the receive path and message
+ * construction normally never reach the global allocator. Caches that grow too large spill
+ * half of their blocks to a shared list, and empty caches refill from it before falling back
+ * to operator new. The shared lists are capped, blocks spilled beyond the cap go back to
+ * operator delete so a burst doesn't pin its memory for good. Anything larger than the
+ * biggest class goes straight to operator new.
+ */
+class bufferpool {
+public:
+    static constexpr size_t MIN_CLASS_SHIFT = 6;
+    static constexpr size_t MAX_CLASS_SHIFT = 16;
+    static constexpr size_t CLASS_COUNT = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+
+    // Bytes of free blocks a thread may cache per class before spilling to the shared list
+    static constexpr size_t THREAD_CACHE_BYTES = 256 * 1024;
+    // Bytes of free blocks the shared list keeps per class, the rest is freed
+    static constexpr size_t SHARED_LIST_BYTES = 4 * 1024 * 1024;
+
+    struct stats {
+        // Allocations served from a thread cache or the shared lists
+        uint64_t hits = 0;
+        // Allocations that had to go to operator new
+        uint64_t misses = 0;
+        // Allocations too large for any size class
+        uint64_t oversized = 0;
+        uint64_t frees = 0;
+
+        double hitRate() const {
+            uint64_t total = this->hits + this->misses + this->oversized;
+            return total > 0 ? (double)this->hits / (double)total : 0.0;
+        }
+    };
+
+public:
+    // Returns at least bytes of storage, capacity receives the usable size of the block
+    static void* allocate(size_t bytes, size_t& capacity) {
+        size_t sizeClass = classOf(bytes);
+        if (sizeClass == CLASS_COUNT) {
+            capacity = bytes;
+            cache().oversized.fetch_add(1, std::memory_order_relaxed);
+            return ::operator new(bytes);
+        }
+
+        capacity = classSize(sizeClass);
+
+        ThreadCache& local = cache();
+        FreeBlock* block = local.lists[sizeClass];
+        if (!block) {
+            block = refill(local, sizeClass);
+        }
+
+        if (block) {
+            local.lists[sizeClass] = block->next;
+            local.counts[sizeClass]--;
+            local.hits.fetch_add(1, std::memory_order_relaxed);
+            return block;
+        }
+
+        local.misses.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(capacity);
+    }
+
+    // capacity must be the value allocate handed back for memory
+    static void deallocate(void* memory, size_t capacity) {
+        size_t sizeClass = classOf(capacity);
+        ThreadCache& local = cache();
+        local.frees.fetch_add(1, std::memory_order_relaxed);
+
+        if (sizeClass == CLASS_COUNT) {
+            ::operator delete(memory);
+            return;
+        }
+
+        FreeBlock* block = static_cast<FreeBlock*>(memory);
+        block->next = local.lists[sizeClass];
+        local.lists[sizeClass] = block;
+        local.counts[sizeClass]++;
+
+        if (local.counts[sizeClass] * classSize(sizeClass) > THREAD_CACHE_BYTES) {
+            spill(local, sizeClass, local.counts[sizeClass] / 2);
+        }
+    }
+
+    // Totals across every thread that has used the pool
+    static stats Stats() {
+        Shared& shared = global();
+        std::scoped_lock lock(shared.mutex);
+
+        stats total = shared.retired;
+        for (ThreadCache* local : shared.caches) {
+            total.hits += local->hits.load(std::memory_order_relaxed);
+            total.misses += local->misses.load(std::memory_order_relaxed);
+            total.oversized += local->oversized.load(std::memory_order_relaxed);
+            total.frees += local->frees.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct ThreadCache {
+        FreeBlock* lists[CLASS_COUNT] = {};
+        size_t counts[CLASS_COUNT] = {};
+
+        // Only written by the owning thread, atomic so Stats() can read them from anywhere
+        std::atomic<uint64_t> hits { 0 };
+        std::atomic<uint64_t> misses { 0 };
+        std::atomic<uint64_t> oversized { 0 };
+        std::atomic<uint64_t> frees { 0 };
+
+        ThreadCache() {
+            Shared& shared = global();
+            std::scoped_lock lock(shared.mutex);
+            shared.caches.push_back(this);
+        }
+
+        // Hands the cached blocks and counters over to the shared state when the thread exits
+        ~ThreadCache() {
+            for (size_t i = 0; i < CLASS_COUNT; i++) {
+                spill(*this, i, this->counts[i]);
+            }
+
+            Shared& shared = global();
+            std::scoped_lock lock(shared.mutex);
+            shared.retired.hits += this->hits.load(std::memory_order_relaxed);
+            shared.retired.misses += this->misses.load(std::memory_order_relaxed);
+            shared.retired.oversized += this->oversized.load(std::memory_order_relaxed);
+            shared.retired.frees += this->frees.load(std::memory_order_relaxed);
+            for (auto it = shared.caches.begin(); it != shared.caches.end(); it++) {
+                if (*it == this) {
+                    shared.caches.erase(it);
+                    break;
+                }
+            }
+        }
+    };
+
+    struct Shared {
+        std::mutex mutex;
+        FreeBlock* lists[CLASS_COUNT] = {};
+        size_t counts[CLASS_COUNT] = {};
+
+        std::vector<ThreadCache*> caches;
+        stats retired;
+    };
+
+    static size_t classSize(size_t sizeClass) {
+        return size_t(1) << (sizeClass + MIN_CLASS_SHIFT);
+    }
+
+    // Returns CLASS_COUNT for sizes above the largest class
+    static size_t classOf(size_t bytes) {
+        size_t sizeClass = 0;
+        while (sizeClass < CLASS_COUNT && classSize(sizeClass) < bytes) {
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+
+    // Never destroyed so blocks can still be returned while other statics are torn down
+    static Shared& global() {
+        static Shared* shared = new Shared();
+        return *shared;
+    }
+
+    static ThreadCache& cache() {
+        thread_local ThreadCache local;
+        return local;
+    }
+
+    // Moves up to half a cache worth of blocks from the shared list into the thread cache
+    static FreeBlock* refill(ThreadCache& local, size_t sizeClass) {
+        Shared& shared = global();
+        std::scoped_lock lock(shared.mutex);
+
+        size_t batch = THREAD_CACHE_BYTES / classSize(sizeClass) / 2;
+        if (batch == 0) {
+            batch = 1;
+        }
+
+        while (batch-- > 0 && shared.lists[sizeClass]) {
+            FreeBlock* block = shared.lists[sizeClass];
+            shared.lists[sizeClass] = block->next;
+            shared.counts[sizeClass]--;
+
+            block->next = local.lists[sizeClass];
+            local.lists[sizeClass] = block;
+            local.counts[sizeClass]++;
+        }
+        return local.lists[sizeClass];
+    }
+
+    static void spill(ThreadCache& local, size_t sizeClass, size_t count) {
+        if (count == 0) {
+            return;
+        }
+
+        // Freed once the lock is released
+        FreeBlock* excess = nullptr;
+        {
+            Shared& shared = global();
+            std::scoped_lock lock(shared.mutex);
+            size_t room = SHARED_LIST_BYTES / classSize(sizeClass);
+            while (count-- > 0 && local.lists[sizeClass]) {
+                FreeBlock* block = local.lists[sizeClass];
+                local.lists[sizeClass] = block->next;
+                local.counts[sizeClass]--;
+
+                if (shared.counts[sizeClass] < room) {
+                    block->next = shared.lists[sizeClass];
+                    shared.lists[sizeClass] = block;
+                    shared.counts[sizeClass]++;
+                } else {
+                    block->next = excess;
+                    excess = block;
+                }
+            }
+        }
+
+        while (excess) {
+            FreeBlock* block = excess;
+            excess = block->next;
+            ::operator delete(block);
+        }
+    }
+};
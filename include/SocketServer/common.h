@@ -8,6 +8,9 @@
 #define ASIO_HAS_STD_TYPE_TRAITS
 #define ASIO_HAS_STD_ATOMIC
 
+// asio/awaitable.hpp uses std::exchange without including it, which a C++20 build pulls in
+#include <utility>
+
 #include <asio.hpp>
 #include <asio/ts/buffer.hpp>
 #include <asio/ts/internet.hpp>
@@ -18,6 +21,9 @@
 #include <vector>
 
 #include "logging.h"
+#include "sharedbuffer.h"
+#include "slotmap.h"
+#include "transport.h"
 
 enum MessageType: uint32_t {
     Success,
@@ -30,13 +36,48 @@ enum MessageType: uint32_t {
     CubePulse,
     CubeRehoboam,
     SetSolidColor,
-    CubeChristmas
+    CubeChristmas,
+
+    // The body is a list of uint32_t message ids or categories, see SocketServer::Subscribe
+    ServerSubscribe,
+    ServerUnsubscribe,
+    ServerSubscribeCategory,
+    ServerUnsubscribeCategory
+};
+
+// Groups of MessageType a client can subscribe to at once
+enum MessageCategory: uint32_t {
+    CubeCommands,
+    ServerCommands
 };
 
 enum ClientType: uint8_t {
     WEB,
     CUBE
 };
+
+// Wire features a peer announces in its Hello, the server answers with the ones both sides support
+enum Capability: uint32_t {
+    BATCHING = 1 << 0,
+    COMPRESSION = 1 << 1,
+    DATAGRAMS = 1 << 2
+};
+
+// Frames with this id carry a Hello rather than an application message, it is far above any MessageType
+// so a peer that predates the hello sees a message it doesn't know and ignores it
+constexpr uint32_t HELLO_FRAME_ID = 0x4F4C4548;
+constexpr uint16_t PROTOCOL_VERSION = 1;
+
+// First frame a client sends once connected, the server replies with one holding the negotiated capabilities
+// Later versions may only append fields, a peer reads the fields it knows and ignores the rest
+struct Hello {
+    uint16_t version = PROTOCOL_VERSION;
+    ClientType type = WEB;
+    uint8_t reserved = 0;
+    uint32_t capabilities = 0;
+    uint64_t deviceId = 0;
+};
+static_assert(sizeof(Hello) == 16, "Hello is sent as is and must not have padding");
 template <typename T>
 struct MessageHeader {
     T id {};
@@ -46,7 +87,9 @@ struct MessageHeader {
 template <typename T>
 struct Message {
     MessageHeader<T> header {};
-    std::vector<uint8_t> body;
+
+    // Copies of a message share the body, so relaying one to many recipients never copies it
+    sharedbuffer body;
 
     // Returns the size of the entire message body in bytes.
     size_t size() const {
@@ -63,14 +106,8 @@ struct Message {
     friend Message<T>& operator << (Message<T>& msg, const DataType& data) {
         static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pushed into vector");
 
-        // Save the current size of the body, this will be the point where we save the new data
-        size_t currentBodySize = msg.body.size();
-
-        // Resize the body vector
-        msg.body.resize(msg.body.size() + sizeof(DataType));
-
-        // Copy the data into the new space
-        std::memcpy(msg.body.data() + currentBodySize, &data, sizeof(DataType));
+        // Copy the data onto the end of the body, a body shared with other messages is detached first
+        msg.body.append(&data, sizeof(DataType));
 
         // Recalculate the message size
         msg.header.size = msg.size();
@@ -89,7 +126,8 @@ struct Message {
         // Physically copy the data from the vector into the user variable
         std::memcpy(&data, msg.body.data() + i, sizeof(DataType));
 
-        // Shrink the vector to remove read bytes, and reset end position
+        // Shrink the body to remove read bytes, and reset end position
+        // This only narrows this message's view, other messages sharing the body are unaffected
         msg.body.resize(i);
 
         // Recalculate the message size
@@ -100,18 +138,76 @@ struct Message {
     }
 };
 
+// Frames with this id carry a message addressed to devices, see Address()
+constexpr uint32_t ROUTED_FRAME_ID = 0x54554F52;
 
-// Forward declare the SocketConnection
+// Wraps msg so the server only delivers it to the devices in targets, the ids they sent in their Hello
+// The targets and msg's own id travel behind its body, the server pops them off and forwards what is left
+template <typename T>
+Message<T> Address(const Message<T>& msg, const std::vector<uint64_t>& targets) {
+    Message<T> routed = msg;
+    routed.header.id = (T)ROUTED_FRAME_ID;
+    routed << msg.header.id;
+    for (uint64_t target : targets) {
+        routed << target;
+    }
+    routed << (uint32_t)targets.size();
+    return routed;
+}
+
+// Turns a frame made by Address() back into the message it carries, returns false if it is malformed
+// Only narrows the body, the forwarded message shares it with the frame it arrived in
 template <typename T>
+bool Unaddress(Message<T>& msg, std::vector<uint64_t>& targets) {
+    uint32_t count;
+    if (msg.size() < sizeof(count)) {
+        return false;
+    }
+    msg >> count;
+
+    if (msg.size() < (size_t)count * sizeof(uint64_t) + sizeof(T)) {
+        return false;
+    }
+    targets.resize(count);
+    for (uint32_t i = count; i > 0; i--) {
+        msg >> targets[i - 1];
+    }
+
+    T id;
+    msg >> id;
+    msg.header.id = id;
+    return true;
+}
+
+
+/**
+ * Where a piece of a streamed body belongs, see InboundLimits::streamThreshold.
+ * A streamed piece keeps the header of the whole message, so header.size is the total body size
+ * while the body only holds the bytes starting at offset.
+ */
+struct MessageChunk
+{
+    bool streamed = false;
+    uint32_t offset = 0;
+    bool last = false;
+};
+
+// Forward declare the SocketConnection
+template <typename T, typename Transport>
 class SocketConnection;
 
 /**
  * Owned Messages are identical to regular messages, however, they are associated with a conneciton. 
  * On the server, the owner would be the client that sent the message and visa versa.
+ * The connection is named by its handle in the server's registry rather than held, so queueing a
+ * message doesn't touch the connection's reference count. On the client the handle is left invalid.
  */
-template <typename T>
+template <typename T, typename Transport = tls_transport>
 struct OwnedMessage
 {
-    std::shared_ptr<SocketConnection<T>> remote = nullptr;
+    slothandle remote;
     Message<T> message;
+    MessageChunk chunk;
+    // Queued behind the last message of a connection whose read loop ended, its slot is freed once this is reached
+    bool closed = false;
 };
@@ -0,0 +1,170 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Recycling storage for asio completion handlers
+ *
+ * Every async operation allocates memory for its handler. A handler_memory keeps a few
+ * fixed size blocks that are handed out again once the operation that used them completes,
+ * so a connection's steady state message flow allocates nothing for handler storage.
+ * When every block is busy, or a handler is too large, it falls back to operator new.
+ *
+ * Blocks carry their own state so they can be returned from any thread, and even after the
+ * handler_memory that handed them out is gone. This happens for operations still pending
+ * when an io_context is destroyed.
+ */
+class handler_memory {
+public:
+    static constexpr size_t SLOT_COUNT = 8;
+    static constexpr size_t BLOCK_SIZE = 1024;
+
+private:
+    enum State: uint8_t {
+        FREE,
+        IN_USE,
+        // The owning handler_memory is gone, whoever returns the block frees it
+        ORPHANED,
+        // Fallback allocation that never belonged to a slot
+        UNPOOLED
+    };
+
+    struct alignas(16) BlockHeader {
+        std::atomic<uint8_t> state;
+    };
+
+    std::atomic<BlockHeader*> slots[SLOT_COUNT] = {};
+
+public:
+    handler_memory() = default;
+    handler_memory(const handler_memory&) = delete;
+    handler_memory& operator=(const handler_memory&) = delete;
+
+    ~handler_memory() {
+        for (auto& slot : this->slots) {
+            BlockHeader* block = slot.load(std::memory_order_acquire);
+            if (block && block->state.exchange(ORPHANED, std::memory_order_acq_rel) == FREE) {
+                release(block);
+            }
+        }
+    }
+
+    void* allocate(size_t size) {
+        if (size <= BLOCK_SIZE) {
+            for (auto& slot : this->slots) {
+                BlockHeader* block = slot.load(std::memory_order_acquire);
+                if (!block) {
+                    // Lazily fill the slot, only as many blocks as there are concurrent operations get created
+                    BlockHeader* fresh = create(BLOCK_SIZE, IN_USE);
+                    if (slot.compare_exchange_strong(block, fresh, std::memory_order_acq_rel)) {
+                        return fresh + 1;
+                    }
+                    release(fresh);
+                }
+
+                uint8_t expected = FREE;
+                if (block->state.compare_exchange_strong(expected, IN_USE, std::memory_order_acquire)) {
+                    return block + 1;
+                }
+            }
+        }
+
+        return create(size, UNPOOLED) + 1;
+    }
+
+    // Doesn't touch the handler_memory the block came from, only the block itself
+    static void deallocate(void* memory) {
+        BlockHeader* block = static_cast<BlockHeader*>(memory) - 1;
+        if (block->state.load(std::memory_order_relaxed) == UNPOOLED) {
+            release(block);
+            return;
+        }
+
+        if (block->state.exchange(FREE, std::memory_order_acq_rel) == ORPHANED) {
+            release(block);
+        }
+    }
+
+private:
+    static BlockHeader* create(size_t size, State state) {
+        void* memory = ::operator new(sizeof(BlockHeader) + size);
+        BlockHeader* block = new (memory) BlockHeader;
+        block->state.store(state, std::memory_order_relaxed);
+        return block;
+    }
+
+    static void release(BlockHeader* block) {
+        block->~BlockHeader();
+        ::operator delete(block);
+    }
+};
+
+// Allocator handed to asio through a handler's associated allocator
+template<typename T>
+class handler_allocator {
+public:
+    using value_type = T;
+
+    explicit handler_allocator(handler_memory& memory)
+        : memory(&memory)
+    {}
+
+    template<typename U>
+    handler_allocator(const handler_allocator<U>& other) noexcept
+        : memory(other.memory)
+    {}
+
+    T* allocate(size_t n) const {
+        return static_cast<T*>(this->memory->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, size_t n) const {
+        handler_memory::deallocate(p);
+    }
+
+    bool operator==(const handler_allocator& other) const noexcept {
+        return this->memory == other.memory;
+    }
+
+    bool operator!=(const handler_allocator& other) const noexcept {
+        return this->memory != other.memory;
+    }
+
+private:
+    template<typename> friend class handler_allocator;
+
+    handler_memory* memory;
+};
+
+// Wraps a completion handler so asio allocates its operation from a handler_memory
+template<typename Handler>
+class custom_alloc_handler {
+public:
+    using allocator_type = handler_allocator<Handler>;
+
+    custom_alloc_handler(handler_memory& memory, Handler handler)
+        : memory(memory), handler(std::move(handler))
+    {}
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type(this->memory);
+    }
+
+    template<typename... Args>
+    void operator()(Args&&... args) {
+        this->handler(std::forward<Args>(args)...);
+    }
+
+private:
+    handler_memory& memory;
+    Handler handler;
+};
+
+template<typename Handler>
+inline custom_alloc_handler<typename std::decay<Handler>::type> make_custom_alloc_handler(handler_memory& memory, Handler&& handler) {
+    return custom_alloc_handler<typename std::decay<Handler>::type>(memory, std::forward<Handler>(handler));
+}
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <ctime>
+#include <type_traits>
 #include <asio.hpp>
 
 enum ProgramType {
@@ -93,4 +94,21 @@ void inline LOG(LogLevel level, std::string message, asio::ip::tcp::endpoint end
     if (validateLog(level)) {
         std::cout << "[" << levelToSring(level) << "] " << "[" << timestamp() << "]" << " [" << endpoint << "] " << message << ": " << data << std::endl;
     }
-}
\ No newline at end of file
+}
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+// Templates so a string literal never converts into a socket path
+template<typename Endpoint, typename std::enable_if<std::is_same<Endpoint, asio::local::stream_protocol::endpoint>::value, int>::type = 0>
+void inline LOG(LogLevel level, std::string message, Endpoint endpoint) {
+    if (validateLog(level)) {
+        std::cout << "[" << levelToSring(level) << "] " << "[" << timestamp() << "]" << " [" << endpoint << "] " << message << std::endl;
+    }
+}
+
+template<typename Endpoint, typename std::enable_if<std::is_same<Endpoint, asio::local::stream_protocol::endpoint>::value, int>::type = 0>
+void inline LOG(LogLevel level, std::string message, Endpoint endpoint, std::string data) {
+    if (validateLog(level)) {
+        std::cout << "[" << levelToSring(level) << "] " << "[" << timestamp() << "]" << " [" << endpoint << "] " << message << ": " << data << std::endl;
+    }
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/**
+ * Byte budget shared by every connection of a server
+ *
+ * Connections charge the memory their queued messages and large frames being received hold and release
+ * it once that memory is gone. A budget with a limit of 0 only counts. Once it is exhausted,
+ * connections stop reading and wait on the budget, every waiter is called once enough is
+ * released to bring the usage back under the limit.
+ */
+class memorybudget {
+public:
+    struct stats {
+        size_t used = 0;
+        size_t peak = 0;
+        size_t limit = 0;
+    };
+
+private:
+    std::atomic<size_t> nUsed { 0 };
+    std::atomic<size_t> nPeak { 0 };
+    std::atomic<size_t> nLimit { 0 };
+
+    std::atomic<bool> bHasWaiters { false };
+    std::vector<std::function<void()>> waiters;
+    std::mutex muxWaiters;
+
+public:
+    memorybudget() = default;
+    memorybudget(const memorybudget&) = delete;
+    memorybudget& operator=(const memorybudget&) = delete;
+
+public:
+    // 0 removes the limit
+    void set_limit(size_t bytes) {
+        this->nLimit.store(bytes);
+        this->wake();
+    }
+
+    size_t limit() const {
+        return this->nLimit.load(std::memory_order_relaxed);
+    }
+
+    size_t used() const {
+        return this->nUsed.load(std::memory_order_relaxed);
+    }
+
+    bool exhausted() const {
+        size_t limit = this->nLimit.load();
+        return limit > 0 && this->nUsed.load() >= limit;
+    }
+
+    stats Stats() const {
+        stats current;
+        current.used = this->used();
+        current.peak = this->nPeak.load(std::memory_order_relaxed);
+        current.limit = this->limit();
+        return current;
+    }
+
+    // Charging always succeeds, callers check exhausted() before taking on more
+    void charge(size_t bytes) {
+        size_t used = this->nUsed.fetch_add(bytes) + bytes;
+        size_t peak = this->nPeak.load(std::memory_order_relaxed);
+        while (used > peak && !this->nPeak.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {}
+    }
+
+    void release(size_t bytes) {
+        this->nUsed.fetch_sub(bytes);
+        // Pairs with wait() so either it sees the release or we see its waiter
+        if (this->bHasWaiters.load() && !this->exhausted()) {
+            this->wake();
+        }
+    }
+
+    // Calls waiter once the budget is no longer exhausted, which may be right away on this thread
+    void wait(std::function<void()> waiter) {
+        {
+            std::scoped_lock lock(this->muxWaiters);
+            this->waiters.push_back(std::move(waiter));
+            this->bHasWaiters.store(true);
+        }
+
+        if (!this->exhausted()) {
+            this->wake();
+        }
+    }
+
+private:
+    void wake() {
+        std::vector<std::function<void()>> ready;
+        {
+            std::scoped_lock lock(this->muxWaiters);
+            ready.swap(this->waiters);
+            this->bHasWaiters.store(false);
+        }
+
+        for (auto& waiter : ready) {
+            waiter();
+        }
+    }
+};
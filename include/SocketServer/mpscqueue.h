@@ -0,0 +1,228 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Bounded lock free multi producer / single consumer queue
+ *
+ * Any number of threads may push, but only one thread may pop, drain or wait.
+ * Each slot carries a sequence number so producers claim slots with a single CAS
+ * and the consumer never takes a lock. The consumer only touches the mutex when it
+ * is about to sleep, and producers only touch it when they know the consumer is asleep.
+ * Producers that must not block, such as io threads, use try_push and wait_for_space to
+ * be called back once the consumer made room.
+ */
+template<typename T>
+class mpscqueue {
+protected:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> buffer;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> enqueuePos { 0 };
+    alignas(64) std::atomic<size_t> dequeuePos { 0 };
+
+    alignas(64) std::atomic<bool> bSleeping { false };
+    std::condition_variable cvBlocking;
+    std::mutex muxBlocking;
+
+    // Producers waiting for room, the consumer only takes the lock when there are some
+    alignas(64) std::atomic<bool> bHasWaiters { false };
+    std::vector<std::function<void()>> waiters;
+    std::mutex muxWaiters;
+
+public:
+    // capacity is rounded up to the next power of two
+    explicit mpscqueue(size_t capacity = 1 << 16) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+
+        this->buffer = std::make_unique<Cell[]>(size);
+        this->mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            this->buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    mpscqueue(const mpscqueue<T>&) = delete;
+    virtual ~mpscqueue() {
+        this->clear();
+    }
+
+public:
+    // Adds an item to the back of the queue, returns false when the queue is full
+    // On failure item is left untouched so the caller can retry with it
+    bool try_push(T&& item) {
+        Cell* cell;
+        size_t pos = this->enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &this->buffer[pos & this->mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+            if (dif == 0) {
+                if (this->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = this->enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        this->notify();
+        return true;
+    }
+
+    // Adds an item to the back of the queue, yields while the queue is full
+    // Not for io threads, which would stall every connection they serve until the consumer catches up
+    void push_back(T item) {
+        while (!this->try_push(std::move(item))) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Consumer only - Removes the first item into out, returns false if the queue is empty
+    bool try_pop(T& out) {
+        size_t pos = this->dequeuePos.load(std::memory_order_relaxed);
+        Cell* cell = &this->buffer[pos & this->mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+            return false;
+        }
+
+        out = std::move(cell->data);
+        // Don't keep whatever the item owns alive until the slot is reused
+        cell->data = T();
+        cell->sequence.store(pos + this->mask + 1, std::memory_order_release);
+        this->dequeuePos.store(pos + 1, std::memory_order_relaxed);
+
+        // Pairs with the fence in wait_for_space so either it sees the room or we see its waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (this->bHasWaiters.load(std::memory_order_relaxed)) {
+            this->wake();
+        }
+        return true;
+    }
+
+    // Consumer only - Removes and returns first item of queue, the queue must not be empty
+    T pop_front() {
+        T t;
+        this->try_pop(t);
+        return t;
+    }
+
+    // Consumer only - Hands every available item to handler in order, returns how many were handled
+    // Items pushed while draining are picked up in the same call
+    template<typename Handler>
+    size_t drain(Handler&& handler, size_t max = SIZE_MAX) {
+        size_t count = 0;
+        T item;
+        while (count < max && this->try_pop(item)) {
+            handler(item);
+            count++;
+        }
+        return count;
+    }
+
+    // Consumer only - Returns true if the queue has no items
+    bool empty() {
+        size_t pos = this->dequeuePos.load(std::memory_order_relaxed);
+        size_t seq = this->buffer[pos & this->mask].sequence.load(std::memory_order_acquire);
+        return (intptr_t)seq - (intptr_t)(pos + 1) < 0;
+    }
+
+    // Returns the number of items in the queue, only a snapshot while producers are active
+    size_t count() const {
+        size_t enqueued = this->enqueuePos.load(std::memory_order_relaxed);
+        size_t dequeued = this->dequeuePos.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    size_t capacity() const {
+        return this->mask + 1;
+    }
+
+    // Consumer only - Clears the queue
+    void clear() {
+        T item;
+        while (this->try_pop(item)) {}
+    }
+
+    // Consumer only - While the queue is empty it waits until an item gets added.
+    // Calling this prevents the program from consuming 100% of a CPU core 24/7
+    void wait() {
+        while (!this->wait_for(std::chrono::hours(1))) {}
+    }
+
+    // Consumer only - Waits until an item gets added or the timeout passes, returns false on timeout
+    template<typename Rep, typename Period>
+    bool wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+        if (!this->empty()) {
+            return true;
+        }
+
+        std::unique_lock<std::mutex> ul(this->muxBlocking);
+        this->bSleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool ready = this->cvBlocking.wait_for(ul, timeout, [this]() { return !this->empty(); });
+
+        this->bSleeping.store(false, std::memory_order_relaxed);
+        return ready;
+    }
+
+    // Calls waiter once the queue has room, which may be right away on this thread
+    // Otherwise it runs on the consumer's thread, so it should only post the retry to where the producer runs
+    void wait_for_space(std::function<void()> waiter) {
+        {
+            std::scoped_lock lock(this->muxWaiters);
+            this->waiters.push_back(std::move(waiter));
+            this->bHasWaiters.store(true, std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (this->count() < this->capacity()) {
+            this->wake();
+        }
+    }
+
+private:
+    void wake() {
+        std::vector<std::function<void()>> ready;
+        {
+            std::scoped_lock lock(this->muxWaiters);
+            ready.swap(this->waiters);
+            this->bHasWaiters.store(false, std::memory_order_relaxed);
+        }
+
+        for (auto& waiter : ready) {
+            waiter();
+        }
+    }
+
+    void notify() {
+        // Pairs with the fence in wait_for so either the consumer sees the item or we see it sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (this->bSleeping.load(std::memory_order_relaxed)) {
+            std::unique_lock<std::mutex> ul(this->muxBlocking);
+            this->cvBlocking.notify_one();
+        }
+    }
+};
@@ -0,0 +1,206 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+
+#include "bufferpool.h"
+
+// Bodies up to this many bytes are stored inside the message itself and never allocate
+#ifndef MESSAGE_INLINE_BODY_SIZE
+#define MESSAGE_INLINE_BODY_SIZE 32
+#endif
+
+/**
+ * Reference counted byte buffer with copy on write semantics
+ *
+ * Copying a sharedbuffer only bumps a reference count, so a received frame can sit in the
+ * inbound queue, be handed to a handler and be placed in every recipient's outbound queue
+ * without its bytes ever being copied. The storage is immutable while it is shared, the first
+ * write through a shared copy detaches it onto its own storage. Storage comes from the bufferpool.
+ *
+ * Buffers of at most InlineSize bytes live inline instead, copying those copies the few bytes
+ * and neither allocates nor touches a reference count.
+ */
+template<size_t InlineSize>
+class basic_sharedbuffer {
+protected:
+    struct Block {
+        std::atomic<uint32_t> refs;
+        size_t capacity;
+
+        uint8_t* data() {
+            return reinterpret_cast<uint8_t*>(this + 1);
+        }
+    };
+
+    Block* block = nullptr;
+    size_t nSize = 0;
+
+    // Holds the bytes while block is null
+    uint8_t inlineData[InlineSize];
+
+public:
+    basic_sharedbuffer() = default;
+
+    basic_sharedbuffer(const basic_sharedbuffer& other)
+        : block(other.block), nSize(other.nSize)
+    {
+        if (this->block) {
+            this->block->refs.fetch_add(1, std::memory_order_relaxed);
+        } else if (this->nSize > 0) {
+            std::memcpy(this->inlineData, other.inlineData, this->nSize);
+        }
+    }
+
+    basic_sharedbuffer(basic_sharedbuffer&& other) noexcept
+        : block(other.block), nSize(other.nSize)
+    {
+        if (!this->block && this->nSize > 0) {
+            std::memcpy(this->inlineData, other.inlineData, this->nSize);
+        }
+        other.block = nullptr;
+        other.nSize = 0;
+    }
+
+    basic_sharedbuffer& operator=(basic_sharedbuffer other) noexcept {
+        this->release();
+        this->block = other.block;
+        this->nSize = other.nSize;
+        if (!this->block && this->nSize > 0) {
+            std::memcpy(this->inlineData, other.inlineData, this->nSize);
+        }
+        other.block = nullptr;
+        other.nSize = 0;
+        return *this;
+    }
+
+    ~basic_sharedbuffer() {
+        this->release();
+    }
+
+public:
+    size_t size() const {
+        return this->nSize;
+    }
+
+    bool empty() const {
+        return this->nSize == 0;
+    }
+
+    const uint8_t* data() const {
+        return this->block ? this->block->data() : this->inlineData;
+    }
+
+    // Returns writable storage, detaching from any other copy first
+    uint8_t* mutable_data() {
+        this->reserve(this->nSize);
+        return this->storage();
+    }
+
+    // True if the bytes are held inline rather than in pooled storage
+    bool is_inline() const {
+        return !this->block;
+    }
+
+    // True if other copies currently share this storage
+    bool shared() const {
+        return this->block && this->block->refs.load(std::memory_order_acquire) > 1;
+    }
+
+    void clear() {
+        this->release();
+    }
+
+    // Makes sure this buffer owns its storage alone and can hold at least capacity bytes
+    void reserve(size_t capacity) {
+        if (this->block && !this->shared() && this->block->capacity >= capacity) {
+            return;
+        }
+        if (!this->block && capacity <= InlineSize) {
+            return;
+        }
+
+        // A shared body that still fits inline detaches without allocating
+        if (capacity <= InlineSize) {
+            size_t size = this->nSize;
+            std::memcpy(this->inlineData, this->block->data(), size);
+            this->release();
+            this->nSize = size;
+            return;
+        }
+
+        // Grow geometrically, but a detach only needs what was asked for
+        size_t newCapacity = capacity;
+        if (this->block && !this->shared() && this->block->capacity * 2 > newCapacity) {
+            newCapacity = this->block->capacity * 2;
+        }
+
+        Block* newBlock = allocate(newCapacity);
+        if (this->nSize > 0) {
+            std::memcpy(newBlock->data(), this->data(), this->nSize);
+        }
+
+        size_t size = this->nSize;
+        this->release();
+        this->block = newBlock;
+        this->nSize = size;
+    }
+
+    // Growing zero fills the new bytes, shrinking never touches the storage
+    void resize(size_t size) {
+        if (size > this->nSize) {
+            this->reserve(size);
+            std::memset(this->storage() + this->nSize, 0, size - this->nSize);
+        }
+        this->nSize = size;
+    }
+
+    void append(const void* src, size_t length) {
+        if (length == 0) {
+            return;
+        }
+
+        this->reserve(this->nSize + length);
+        std::memcpy(this->storage() + this->nSize, src, length);
+        this->nSize += length;
+    }
+
+    // Replaces the contents with a fresh copy of [first, last)
+    void assign(const uint8_t* first, const uint8_t* last) {
+        size_t length = last - first;
+        if (this->shared()) {
+            this->release();
+        }
+        this->nSize = 0;
+        this->append(first, length);
+    }
+
+private:
+    uint8_t* storage() {
+        return this->block ? this->block->data() : this->inlineData;
+    }
+
+    static Block* allocate(size_t capacity) {
+        size_t allocated = 0;
+        void* memory = bufferpool::allocate(sizeof(Block) + capacity, allocated);
+        Block* block = new (memory) Block;
+        block->refs.store(1, std::memory_order_relaxed);
+        // Whatever the size class rounded up to is usable as well
+        block->capacity = allocated - sizeof(Block);
+        return block;
+    }
+
+    void release() {
+        if (this->block && this->block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            size_t allocated = sizeof(Block) + this->block->capacity;
+            this->block->~Block();
+            bufferpool::deallocate(this->block, allocated);
+        }
+        this->block = nullptr;
+        this->nSize = 0;
+    }
+};
+
+typedef basic_sharedbuffer<MESSAGE_INLINE_BODY_SIZE> sharedbuffer;
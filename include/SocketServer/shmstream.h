@@ -0,0 +1,433 @@
+#pragma once
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Stream over a pair of shared memory rings, for peers on the same host
+ *
+ * The connection starts out as a Unix domain socket. Its handshake has the accepting side
+ * create a memfd holding one single producer, single consumer ring per direction and pass it
+ * over the socket, from then on every write is a copy into the peer's ring. The socket stays
+ * on as the doorbell: a side only writes a byte to it when the other one has parked waiting
+ * for data or for space, so while the ring is busy frames move without any system call. Closing
+ * the socket, or the peer going away, wakes whatever is parked.
+ *
+ * It is an AsyncReadStream and AsyncWriteStream, asio::async_read and async_write take it like
+ * they take a socket.
+ *
+ * This is not zero-copy. A frame is copied into the ring by the writer, out of the ring into the
+ * connection's read buffer, and from there into its Message by the framing every transport shares.
+ * What it saves over a socket are the system calls and the kernel's own copies, parsing straight
+ * out of the ring would need a read path of its own in SocketConnection.
+ */
+class shmstream {
+public:
+    typedef asio::local::stream_protocol::socket lowest_layer_type;
+    typedef lowest_layer_type::executor_type executor_type;
+
+    // Bytes per direction, the accepting side picks it, must be a power of two
+    static constexpr size_t RING_SIZE = 1024 * 1024;
+
+private:
+    // Each counter sits on its own cache line so the two sides don't fight over one
+    struct ring {
+        // Total bytes ever written and read, the difference is what's waiting in the ring
+        alignas(64) std::atomic<uint64_t> head { 0 };
+        alignas(64) std::atomic<uint64_t> tail { 0 };
+        // Set before a side parks, whoever clears it owes that side a doorbell
+        alignas(64) std::atomic<uint32_t> readerParked { 0 };
+        std::atomic<uint32_t> writerParked { 0 };
+    };
+
+    lowest_layer_type socket;
+
+    uint8_t* region = nullptr;
+    size_t regionSize = 0;
+    size_t capacity = 0;
+
+    // The accepting side writes the first ring and reads the second, the connecting side the other way around
+    ring* rx = nullptr;
+    uint8_t* rxData = nullptr;
+    ring* tx = nullptr;
+    uint8_t* txData = nullptr;
+
+public:
+    template<typename Executor>
+    explicit shmstream(const Executor& executor)
+        : socket(executor)
+    {}
+
+    shmstream(const shmstream&) = delete;
+    shmstream& operator=(const shmstream&) = delete;
+
+    ~shmstream() {
+        if (this->region) {
+            ::munmap(this->region, this->regionSize);
+        }
+    }
+
+public:
+    lowest_layer_type& lowest_layer() {
+        return this->socket;
+    }
+
+    executor_type get_executor() {
+        return this->socket.get_executor();
+    }
+
+    // ASYNC - The server maps the rings and hands them over, the client waits for them
+    // Every async operation takes a completion token, so callbacks and coroutines both work
+    template<typename HandshakeHandler>
+    auto async_handshake(asio::ssl::stream_base::handshake_type type, HandshakeHandler&& handler) {
+        return asio::async_initiate<HandshakeHandler, void(std::error_code)>(
+            [this](auto&& handler, asio::ssl::stream_base::handshake_type type) {
+                this->Handshake(type, std::move(handler));
+            }, handler, type);
+    }
+
+    template<typename MutableBufferSequence, typename ReadHandler>
+    auto async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler) {
+        return asio::async_initiate<ReadHandler, void(std::error_code, std::size_t)>(
+            [this](auto&& handler, const MutableBufferSequence& buffers) {
+                this->Read(buffers, std::move(handler));
+            }, handler, buffers);
+    }
+
+    template<typename ConstBufferSequence, typename WriteHandler>
+    auto async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler) {
+        return asio::async_initiate<WriteHandler, void(std::error_code, std::size_t)>(
+            [this](auto&& handler, const ConstBufferSequence& buffers) {
+                this->Write(buffers, std::move(handler));
+            }, handler, buffers);
+    }
+
+private:
+    template<typename Handler>
+    void Handshake(asio::ssl::stream_base::handshake_type type, Handler handler) {
+        if (type == asio::ssl::stream_base::server) {
+            std::error_code err = this->Create();
+            this->Complete(handler, err);
+            return;
+        }
+
+        this->socket.async_wait(asio::socket_base::wait_read,
+            [this, handler = std::move(handler)](std::error_code err) mutable {
+                if (!err) {
+                    err = this->Attach();
+                }
+                this->Complete(handler, err);
+            }
+        );
+    }
+
+    template<typename MutableBufferSequence, typename Handler>
+    void Read(const MutableBufferSequence& buffers, Handler handler) {
+        std::error_code err;
+        size_t read = this->Consume(buffers, err);
+        if (err || read > 0 || asio::buffer_size(buffers) == 0) {
+            this->Complete(handler, err, read);
+            return;
+        }
+
+        // Park, then look again in case the writer filled the ring before it could see us parked
+        this->rx->readerParked.store(1, std::memory_order_seq_cst);
+        read = this->Consume(buffers, err);
+        if (err || read > 0) {
+            this->rx->readerParked.store(0, std::memory_order_relaxed);
+            this->Complete(handler, err, read);
+            return;
+        }
+
+        this->socket.async_wait(asio::socket_base::wait_read,
+            [this, buffers, handler = std::move(handler)](std::error_code err) mutable {
+                if (!err) {
+                    err = this->Drain();
+                }
+                if (err) {
+                    this->Complete(handler, err, (size_t)0);
+                    return;
+                }
+                this->Read(buffers, std::move(handler));
+            }
+        );
+    }
+
+    template<typename ConstBufferSequence, typename Handler>
+    void Write(const ConstBufferSequence& buffers, Handler handler) {
+        std::error_code err;
+        size_t written = this->Produce(buffers, err);
+        if (err || written > 0 || asio::buffer_size(buffers) == 0) {
+            this->Complete(handler, err, written);
+            return;
+        }
+
+        // The ring is full, park until the reader makes room
+        this->tx->writerParked.store(1, std::memory_order_seq_cst);
+        written = this->Produce(buffers, err);
+        if (err || written > 0) {
+            this->tx->writerParked.store(0, std::memory_order_relaxed);
+            this->Complete(handler, err, written);
+            return;
+        }
+
+        this->socket.async_wait(asio::socket_base::wait_read,
+            [this, buffers, handler = std::move(handler)](std::error_code err) mutable {
+                if (!err) {
+                    err = this->Drain();
+                }
+                if (err) {
+                    this->Complete(handler, err, (size_t)0);
+                    return;
+                }
+                this->Write(buffers, std::move(handler));
+            }
+        );
+    }
+
+    // Copies as much of the receive ring into buffers as there is, and wakes a writer waiting for space
+    template<typename MutableBufferSequence>
+    size_t Consume(const MutableBufferSequence& buffers, std::error_code& err) {
+        if (!this->Usable(err)) {
+            return 0;
+        }
+
+        uint64_t tail = this->rx->tail.load(std::memory_order_relaxed);
+        uint64_t available = this->rx->head.load(std::memory_order_seq_cst) - tail;
+        if (available > this->capacity) {
+            err = asio::error::fault;
+            return 0;
+        }
+
+        size_t copied = 0;
+        for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers) && copied < available; ++it) {
+            asio::mutable_buffer buffer = *it;
+            size_t length = std::min<size_t>(buffer.size(), available - copied);
+            this->CopyOut(static_cast<uint8_t*>(buffer.data()), tail + copied, length);
+            copied += length;
+        }
+
+        if (copied > 0) {
+            this->rx->tail.store(tail + copied, std::memory_order_seq_cst);
+            if (this->rx->writerParked.load(std::memory_order_seq_cst) && this->rx->writerParked.exchange(0)) {
+                this->Ring();
+            }
+        }
+        return copied;
+    }
+
+    // Copies as much of buffers into the send ring as fits, and wakes a reader waiting for data
+    template<typename ConstBufferSequence>
+    size_t Produce(const ConstBufferSequence& buffers, std::error_code& err) {
+        if (!this->Usable(err)) {
+            return 0;
+        }
+
+        uint64_t head = this->tx->head.load(std::memory_order_relaxed);
+        uint64_t used = head - this->tx->tail.load(std::memory_order_seq_cst);
+        if (used > this->capacity) {
+            err = asio::error::fault;
+            return 0;
+        }
+
+        size_t room = this->capacity - used;
+        size_t copied = 0;
+        for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers) && copied < room; ++it) {
+            asio::const_buffer buffer = *it;
+            size_t length = std::min<size_t>(buffer.size(), room - copied);
+            this->CopyIn(static_cast<const uint8_t*>(buffer.data()), head + copied, length);
+            copied += length;
+        }
+
+        if (copied > 0) {
+            this->tx->head.store(head + copied, std::memory_order_seq_cst);
+            if (this->tx->readerParked.load(std::memory_order_seq_cst) && this->tx->readerParked.exchange(0)) {
+                this->Ring();
+            }
+        }
+        return copied;
+    }
+
+    void CopyOut(uint8_t* destination, uint64_t position, size_t length) {
+        size_t offset = (size_t)(position & (this->capacity - 1));
+        size_t first = std::min(length, this->capacity - offset);
+        std::memcpy(destination, this->rxData + offset, first);
+        std::memcpy(destination + first, this->rxData, length - first);
+    }
+
+    void CopyIn(const uint8_t* source, uint64_t position, size_t length) {
+        size_t offset = (size_t)(position & (this->capacity - 1));
+        size_t first = std::min(length, this->capacity - offset);
+        std::memcpy(this->txData + offset, source, first);
+        std::memcpy(this->txData, source + first, length - first);
+    }
+
+    bool Usable(std::error_code& err) {
+        if (!this->socket.is_open() || !this->region) {
+            err = asio::error::bad_descriptor;
+            return false;
+        }
+        return true;
+    }
+
+    // A full socket buffer already holds a doorbell the peer hasn't read, so a failed send is fine
+    void Ring() {
+        char bell = 0;
+        ::send(this->socket.native_handle(), &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    // Swallows the doorbells that woke us, the rings themselves say what changed
+    std::error_code Drain() {
+        char bells[64];
+        while (true) {
+            ssize_t result = ::recv(this->socket.native_handle(), bells, sizeof(bells), MSG_DONTWAIT);
+            if (result == 0) {
+                return asio::error::eof;
+            }
+            if (result < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return std::error_code();
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return std::error_code(errno, asio::error::get_system_category());
+            }
+        }
+    }
+
+    // Server - Maps a fresh pair of rings and sends the memfd to the client
+    std::error_code Create() {
+        int fd = ::memfd_create("socketserver-shm", MFD_CLOEXEC);
+        if (fd < 0) {
+            return std::error_code(errno, asio::error::get_system_category());
+        }
+
+        uint64_t size = 2 * (sizeof(ring) + RING_SIZE);
+        std::error_code err;
+        if (::ftruncate(fd, (off_t)size) < 0) {
+            err = std::error_code(errno, asio::error::get_system_category());
+        }
+        if (!err) {
+            err = this->Map(fd, size, true);
+        }
+        if (!err) {
+            new (this->tx) ring();
+            new (this->rx) ring();
+            err = this->SendDescriptor(fd, size);
+        }
+
+        ::close(fd);
+        return err;
+    }
+
+    // Client - Receives the memfd and maps the rings the server created
+    std::error_code Attach() {
+        uint64_t size = 0;
+        iovec payload { &size, sizeof(size) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+
+        msghdr message {};
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t result = ::recvmsg(this->socket.native_handle(), &message, MSG_CMSG_CLOEXEC);
+        if (result == 0) {
+            return asio::error::eof;
+        }
+        if (result < 0) {
+            return std::error_code(errno, asio::error::get_system_category());
+        }
+
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (result != sizeof(size) || !header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            return asio::error::invalid_argument;
+        }
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(header), sizeof(fd));
+
+        // Don't trust the announced size further than the memfd backs it, touching past its end raises SIGBUS
+        std::error_code err;
+        struct stat info;
+        if (::fstat(fd, &info) < 0 || (uint64_t)info.st_size < size) {
+            err = asio::error::invalid_argument;
+        }
+        if (!err) {
+            err = this->Map(fd, size, false);
+        }
+
+        ::close(fd);
+        return err;
+    }
+
+    std::error_code SendDescriptor(int fd, uint64_t size) {
+        iovec payload { &size, sizeof(size) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        std::memset(control, 0, sizeof(control));
+
+        msghdr message {};
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+
+        if (::sendmsg(this->socket.native_handle(), &message, MSG_NOSIGNAL) != (ssize_t)sizeof(size)) {
+            return std::error_code(errno, asio::error::get_system_category());
+        }
+        return std::error_code();
+    }
+
+    std::error_code Map(int fd, uint64_t size, bool server) {
+        if (size <= 2 * sizeof(ring) || size % 2 != 0) {
+            return asio::error::invalid_argument;
+        }
+        size_t capacity = (size_t)(size / 2 - sizeof(ring));
+        if ((capacity & (capacity - 1)) != 0) {
+            return asio::error::invalid_argument;
+        }
+
+        void* region = ::mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (region == MAP_FAILED) {
+            return std::error_code(errno, asio::error::get_system_category());
+        }
+
+        this->region = static_cast<uint8_t*>(region);
+        this->regionSize = (size_t)size;
+        this->capacity = capacity;
+
+        ring* first = reinterpret_cast<ring*>(this->region);
+        ring* second = reinterpret_cast<ring*>(this->region + sizeof(ring) + capacity);
+        this->tx = server ? first : second;
+        this->rx = server ? second : first;
+        this->txData = reinterpret_cast<uint8_t*>(this->tx) + sizeof(ring);
+        this->rxData = reinterpret_cast<uint8_t*>(this->rx) + sizeof(ring);
+        return std::error_code();
+    }
+
+    // Completions never run inside the initiating call, the same as they wouldn't on a socket
+    // The bound handler keeps the associated allocator and executor, so recycled handler memory is still used
+    template<typename Handler, typename... Args>
+    void Complete(Handler& handler, Args... args) {
+        auto executor = asio::get_associated_executor(handler, this->get_executor());
+        asio::post(executor, asio::detail::bind_handler(std::move(handler), args...));
+    }
+};
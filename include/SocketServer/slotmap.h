@@ -0,0 +1,140 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Names an element of a slotmap, a handle whose element was erased never finds anything again
+struct slothandle {
+    uint32_t index = 0;
+    // 0 is never handed out, so a default handle is always invalid
+    uint32_t generation = 0;
+
+    bool valid() const {
+        return this->generation != 0;
+    }
+
+    bool operator==(const slothandle& other) const {
+        return this->index == other.index && this->generation == other.generation;
+    }
+
+    bool operator!=(const slothandle& other) const {
+        return !(*this == other);
+    }
+};
+
+/**
+ * Generational slot map
+ *
+ * Elements live densely packed in one vector, so walking all of them is a plain array scan.
+ * Handles go through a slot that records where the element currently sits and which generation
+ * of the slot it belongs to. Insert and erase are O(1): an erase moves the last element into the
+ * hole and bumps the slot's generation, so stale handles miss instead of finding whatever reuses
+ * the slot. Not thread safe, the owner guards it.
+ */
+template<typename V>
+class slotmap {
+private:
+    struct slot {
+        uint32_t generation = 1;
+        // Position of the element in values while the slot is taken
+        uint32_t position = 0;
+        bool taken = false;
+    };
+
+    std::vector<slot> slots;
+    std::vector<uint32_t> freeSlots;
+
+    std::vector<V> values;
+    // Slot of every element in values
+    std::vector<uint32_t> owners;
+
+public:
+    typedef typename std::vector<V>::iterator iterator;
+    typedef typename std::vector<V>::const_iterator const_iterator;
+
+    slothandle insert(V value) {
+        uint32_t index;
+        if (!this->freeSlots.empty()) {
+            index = this->freeSlots.back();
+            this->freeSlots.pop_back();
+        } else {
+            index = (uint32_t)this->slots.size();
+            this->slots.emplace_back();
+        }
+
+        slot& s = this->slots[index];
+        s.taken = true;
+        s.position = (uint32_t)this->values.size();
+        this->values.push_back(std::move(value));
+        this->owners.push_back(index);
+
+        return slothandle { index, s.generation };
+    }
+
+    // Returns false if handle is stale
+    bool erase(slothandle handle) {
+        slot* s = this->lookup(handle);
+        if (!s) {
+            return false;
+        }
+
+        uint32_t position = s->position;
+        if (position + 1 != this->values.size()) {
+            this->values[position] = std::move(this->values.back());
+            this->owners[position] = this->owners.back();
+            this->slots[this->owners[position]].position = position;
+        }
+        this->values.pop_back();
+        this->owners.pop_back();
+
+        s->taken = false;
+        // Skip 0 when the generation wraps, it marks invalid handles
+        if (++s->generation == 0) {
+            s->generation = 1;
+        }
+        this->freeSlots.push_back(handle.index);
+        return true;
+    }
+
+    // nullptr if handle is stale
+    V* find(slothandle handle) {
+        slot* s = this->lookup(handle);
+        return s ? &this->values[s->position] : nullptr;
+    }
+
+    const V* find(slothandle handle) const {
+        return const_cast<slotmap*>(this)->find(handle);
+    }
+
+    bool contains(slothandle handle) const {
+        return this->find(handle) != nullptr;
+    }
+
+    size_t size() const {
+        return this->values.size();
+    }
+
+    bool empty() const {
+        return this->values.empty();
+    }
+
+    // Erasing moves elements around, iterators don't survive it
+    iterator begin() { return this->values.begin(); }
+    iterator end() { return this->values.end(); }
+    const_iterator begin() const { return this->values.begin(); }
+    const_iterator end() const { return this->values.end(); }
+
+private:
+    slot* lookup(slothandle handle) {
+        if (handle.index >= this->slots.size()) {
+            return nullptr;
+        }
+
+        slot& s = this->slots[handle.index];
+        if (!s.taken || s.generation != handle.generation) {
+            return nullptr;
+        }
+        return &s;
+    }
+};
@@ -0,0 +1,157 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Recipient index from a key, such as a message id, to the subscribers that want it
+ *
+ * A subscriber starts out unfiltered and receives every key, so peers that predate
+ * subscriptions keep working. Its first subscription switches it to only the keys it
+ * subscribed to. Subscriptions are counted, a key is dropped once it has been unsubscribed
+ * as often as it was subscribed.
+ *
+ * Every recipient list is an unordered vector and each subscriber remembers where it sits in
+ * the lists it is on, so subscribing, unsubscribing and removing take O(1) per key and fan-out
+ * only walks the recipients of the key. Not thread safe, the owner guards it.
+ */
+template<typename Key, typename Subscriber, typename Hash = std::hash<Key>>
+class subscriptionindex {
+private:
+    struct membership {
+        size_t position;
+        size_t count;
+    };
+
+    struct subscriber {
+        bool filtered = false;
+        // Position in unfiltered until the first subscription
+        size_t position = 0;
+        std::unordered_map<Key, membership, Hash> keys;
+    };
+
+    std::unordered_map<Key, std::vector<Subscriber>, Hash> recipients;
+    std::vector<Subscriber> unfiltered;
+    std::unordered_map<Subscriber, subscriber> subscribers;
+
+public:
+    // Adds s as unfiltered, does nothing when it is already known
+    void add(const Subscriber& s) {
+        auto inserted = this->subscribers.emplace(s, subscriber());
+        if (inserted.second) {
+            inserted.first->second.position = this->unfiltered.size();
+            this->unfiltered.push_back(s);
+        }
+    }
+
+    // Forgets s and every subscription it holds
+    void remove(const Subscriber& s) {
+        auto it = this->subscribers.find(s);
+        if (it == this->subscribers.end()) {
+            return;
+        }
+
+        if (!it->second.filtered) {
+            this->erase(this->unfiltered, it->second.position);
+        }
+        for (auto& key : it->second.keys) {
+            auto list = this->recipients.find(key.first);
+            this->erase(list->second, key.second.position, key.first);
+            if (list->second.empty()) {
+                this->recipients.erase(list);
+            }
+        }
+        this->subscribers.erase(it);
+    }
+
+    // Returns true when s wasn't subscribed to key before
+    bool subscribe(const Subscriber& s, const Key& key) {
+        this->add(s);
+        subscriber& state = this->subscribers[s];
+        if (!state.filtered) {
+            state.filtered = true;
+            this->erase(this->unfiltered, state.position);
+        }
+
+        auto existing = state.keys.find(key);
+        if (existing != state.keys.end()) {
+            existing->second.count++;
+            return false;
+        }
+
+        std::vector<Subscriber>& list = this->recipients[key];
+        state.keys.emplace(key, membership { list.size(), 1 });
+        list.push_back(s);
+        return true;
+    }
+
+    // Returns true when s no longer receives key
+    bool unsubscribe(const Subscriber& s, const Key& key) {
+        auto it = this->subscribers.find(s);
+        if (it == this->subscribers.end()) {
+            return false;
+        }
+
+        auto existing = it->second.keys.find(key);
+        if (existing == it->second.keys.end() || --existing->second.count > 0) {
+            return false;
+        }
+
+        auto list = this->recipients.find(key);
+        this->erase(list->second, existing->second.position, key);
+        if (list->second.empty()) {
+            this->recipients.erase(list);
+        }
+        it->second.keys.erase(existing);
+        return true;
+    }
+
+    bool contains(const Subscriber& s) const {
+        return this->subscribers.find(s) != this->subscribers.end();
+    }
+
+    // Calls f for every subscriber that receives key, each one exactly once
+    template<typename F>
+    void for_each(const Key& key, F&& f) const {
+        for (const Subscriber& s : this->unfiltered) {
+            f(s);
+        }
+
+        auto list = this->recipients.find(key);
+        if (list != this->recipients.end()) {
+            for (const Subscriber& s : list->second) {
+                f(s);
+            }
+        }
+    }
+
+    // Number of subscribers that receive key
+    size_t count(const Key& key) const {
+        auto list = this->recipients.find(key);
+        return this->unfiltered.size() + (list != this->recipients.end() ? list->second.size() : 0);
+    }
+
+    size_t size() const {
+        return this->subscribers.size();
+    }
+
+private:
+    // Swaps the last unfiltered subscriber into position and fixes up where it sits
+    void erase(std::vector<Subscriber>& list, size_t position) {
+        if (position + 1 != list.size()) {
+            list[position] = std::move(list.back());
+            this->subscribers[list[position]].position = position;
+        }
+        list.pop_back();
+    }
+
+    // Swaps the last recipient of key into position and fixes up where it sits
+    void erase(std::vector<Subscriber>& list, size_t position, const Key& key) {
+        if (position + 1 != list.size()) {
+            list[position] = std::move(list.back());
+            this->subscribers[list[position]].keys[key].position = position;
+        }
+        list.pop_back();
+    }
+};
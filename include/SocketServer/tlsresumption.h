@@ -0,0 +1,270 @@
+#pragma once
+#include <asio/ssl.hpp>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+
+/**
+ * TLS session resumption for an ssl context
+ *
+ * On the server it turns on the session cache and session tickets, TLS 1.3 resumes through
+ * those tickets as PSKs. Ticket keys are generated in memory and rotated, tickets sealed with
+ * an older key are still accepted until they expire and get renewed with the current key.
+ * On the client it keeps the latest session the server handed out and offers it on the next
+ * handshake, so a reconnect skips the certificate exchange and the asymmetric crypto.
+ *
+ * Both sides count handshakes, how many of them were resumed, and the CPU time spent in them.
+ */
+class tlsresumption {
+public:
+    struct stats {
+        uint64_t handshakes = 0;
+        uint64_t resumed = 0;
+        // CPU time the handshakes took on the io threads, full and resumed ones separately
+        uint64_t fullCpuNanos = 0;
+        uint64_t resumedCpuNanos = 0;
+
+        double hitRate() const {
+            return this->handshakes > 0 ? (double)this->resumed / (double)this->handshakes : 0.0;
+        }
+
+        double averageFullCpuMicros() const {
+            uint64_t full = this->handshakes - this->resumed;
+            return full > 0 ? (double)this->fullCpuNanos / (double)full / 1000.0 : 0.0;
+        }
+
+        double averageResumedCpuMicros() const {
+            return this->resumed > 0 ? (double)this->resumedCpuNanos / (double)this->resumed / 1000.0 : 0.0;
+        }
+    };
+
+private:
+    struct TicketKey {
+        unsigned char name[16];
+        unsigned char aesKey[32];
+        unsigned char hmacKey[32];
+        std::chrono::steady_clock::time_point created;
+    };
+
+    SSL_CTX* context;
+    bool server;
+
+    // Newest key first, only the front one seals new tickets
+    std::deque<TicketKey> ticketKeys;
+    std::chrono::seconds ticketLifetime;
+    std::chrono::seconds rotationInterval;
+    std::mutex muxTickets;
+
+    // The client's most recent resumable session
+    SSL_SESSION* session = nullptr;
+    std::mutex muxSession;
+
+    std::atomic<uint64_t> nHandshakes { 0 };
+    std::atomic<uint64_t> nResumed { 0 };
+    std::atomic<uint64_t> nFullCpuNanos { 0 };
+    std::atomic<uint64_t> nResumedCpuNanos { 0 };
+
+public:
+    // Tickets stay valid for ticketLifetime, the key that seals them is replaced every rotationInterval
+    tlsresumption(asio::ssl::context& context, bool server, std::chrono::seconds ticketLifetime = std::chrono::hours(2), std::chrono::seconds rotationInterval = std::chrono::hours(1))
+        : context(context.native_handle()), server(server), ticketLifetime(ticketLifetime), rotationInterval(rotationInterval)
+    {
+        SSL_CTX_set_ex_data(this->context, contextIndex(), this);
+        SSL_CTX_set_info_callback(this->context, &tlsresumption::OnInfo);
+
+        if (this->server) {
+            // Resumed sessions have to be tied to this application, otherwise client verification refuses them
+            static const unsigned char sessionContext[] = "SocketServer";
+            SSL_CTX_set_session_id_context(this->context, sessionContext, sizeof(sessionContext) - 1);
+            SSL_CTX_set_session_cache_mode(this->context, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(this->context, 20 * 1024);
+            SSL_CTX_set_timeout(this->context, (long)this->ticketLifetime.count());
+
+            this->Rotate();
+            SSL_CTX_set_tlsext_ticket_key_cb(this->context, &tlsresumption::OnTicketKey);
+        } else {
+            // The sessions are kept here rather than in OpenSSL's cache, the client only ever talks to one server
+            SSL_CTX_set_session_cache_mode(this->context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(this->context, &tlsresumption::OnNewSession);
+        }
+    }
+
+    tlsresumption(const tlsresumption&) = delete;
+    tlsresumption& operator=(const tlsresumption&) = delete;
+
+    ~tlsresumption() {
+        SSL_CTX_set_ex_data(this->context, contextIndex(), nullptr);
+        if (this->session) {
+            SSL_SESSION_free(this->session);
+        }
+    }
+
+public:
+    // Client only - Offers the saved session on stream's next handshake
+    template<typename Stream>
+    void Restore(Stream& stream) {
+        std::scoped_lock lock(this->muxSession);
+        if (this->session) {
+            SSL_set_session(stream.native_handle(), this->session);
+        }
+    }
+
+    // Server only - Seals new tickets with a fresh key, tickets of the previous keys are still accepted
+    void Rotate() {
+        std::scoped_lock lock(this->muxTickets);
+        this->RotateLocked();
+    }
+
+    stats Stats() const {
+        stats current;
+        current.handshakes = this->nHandshakes.load(std::memory_order_relaxed);
+        current.resumed = this->nResumed.load(std::memory_order_relaxed);
+        current.fullCpuNanos = this->nFullCpuNanos.load(std::memory_order_relaxed);
+        current.resumedCpuNanos = this->nResumedCpuNanos.load(std::memory_order_relaxed);
+        return current;
+    }
+
+private:
+    // muxTickets must be held
+    void RotateLocked() {
+        TicketKey key;
+        RAND_bytes(key.name, sizeof(key.name));
+        RAND_bytes(key.aesKey, sizeof(key.aesKey));
+        RAND_bytes(key.hmacKey, sizeof(key.hmacKey));
+        key.created = std::chrono::steady_clock::now();
+        this->ticketKeys.push_front(key);
+
+        // A key is useless once every ticket it sealed has expired
+        while (this->ticketKeys.size() > 1 && key.created - this->ticketKeys.back().created > this->ticketLifetime + this->rotationInterval) {
+            this->ticketKeys.pop_back();
+        }
+    }
+
+    static int contextIndex() {
+        static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    // Per connection CPU time spent in the handshake so far
+    static int cpuIndex() {
+        static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    static tlsresumption* Of(const SSL* ssl) {
+        return static_cast<tlsresumption*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), contextIndex()));
+    }
+
+    static uint64_t ThreadCpuNanos() {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+        timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#else
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // OpenSSL reports every state change of a handshake, the CPU time between two reports
+    // of the same call into the handshake is charged to its connection
+    static void OnInfo(const SSL* ssl, int where, int ret) {
+        thread_local const SSL* lastSsl = nullptr;
+        thread_local uint64_t lastCpu = 0;
+
+        tlsresumption* self = Of(ssl);
+        if (!self) {
+            return;
+        }
+
+        uint64_t now = ThreadCpuNanos();
+        SSL* mutableSsl = const_cast<SSL*>(ssl);
+        uintptr_t spent = (uintptr_t)SSL_get_ex_data(mutableSsl, cpuIndex());
+        if (lastSsl == ssl && !(where & SSL_CB_HANDSHAKE_START)) {
+            spent += now - lastCpu;
+            SSL_set_ex_data(mutableSsl, cpuIndex(), (void*)spent);
+        }
+
+        // An exit means the call returned, whatever runs until the next one isn't part of the handshake
+        lastSsl = (where & SSL_CB_EXIT) ? nullptr : ssl;
+        lastCpu = now;
+
+        if (where & SSL_CB_HANDSHAKE_DONE) {
+            self->nHandshakes.fetch_add(1, std::memory_order_relaxed);
+            if (SSL_session_reused(mutableSsl)) {
+                self->nResumed.fetch_add(1, std::memory_order_relaxed);
+                self->nResumedCpuNanos.fetch_add(spent, std::memory_order_relaxed);
+            } else {
+                self->nFullCpuNanos.fetch_add(spent, std::memory_order_relaxed);
+            }
+            SSL_set_ex_data(mutableSsl, cpuIndex(), nullptr);
+        }
+    }
+
+    // Client - Keeps the newest session, TLS 1.3 tickets arrive after the handshake
+    static int OnNewSession(SSL* ssl, SSL_SESSION* session) {
+        tlsresumption* self = Of(ssl);
+        if (!self || !SSL_SESSION_is_resumable(session)) {
+            return 0;
+        }
+
+        // A copy, OpenSSL marks the connection's own session unresumable when the connection drops abruptly
+        SSL_SESSION* copy = SSL_SESSION_dup(session);
+        if (!copy) {
+            return 0;
+        }
+
+        std::scoped_lock lock(self->muxSession);
+        if (self->session) {
+            SSL_SESSION_free(self->session);
+        }
+        self->session = copy;
+        return 0;
+    }
+
+    // Server - Seals tickets with the current key and opens them with any key that hasn't been retired
+    static int OnTicketKey(SSL* ssl, unsigned char keyName[16], unsigned char iv[EVP_MAX_IV_LENGTH], EVP_CIPHER_CTX* cipher, HMAC_CTX* hmac, int encrypt) {
+        tlsresumption* self = Of(ssl);
+        if (!self) {
+            return 0;
+        }
+
+        std::scoped_lock lock(self->muxTickets);
+        if (encrypt) {
+            if (std::chrono::steady_clock::now() - self->ticketKeys.front().created > self->rotationInterval) {
+                self->RotateLocked();
+            }
+
+            const TicketKey& key = self->ticketKeys.front();
+            // AES-256-CBC takes a 16 byte IV
+            if (RAND_bytes(iv, 16) <= 0) {
+                return -1;
+            }
+            std::memcpy(keyName, key.name, sizeof(key.name));
+            EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aesKey, iv);
+            HMAC_Init_ex(hmac, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), nullptr);
+            return 1;
+        }
+
+        for (size_t i = 0; i < self->ticketKeys.size(); i++) {
+            const TicketKey& key = self->ticketKeys[i];
+            if (std::memcmp(keyName, key.name, sizeof(key.name)) == 0) {
+                HMAC_Init_ex(hmac, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), nullptr);
+                EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aesKey, iv);
+                // 2 asks OpenSSL to renew a ticket that was sealed with an old key
+                return i == 0 ? 1 : 2;
+            }
+        }
+
+        // Unknown or retired key, fall back to a full handshake
+        return 0;
+    }
+};
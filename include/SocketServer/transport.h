@@ -0,0 +1,132 @@
+#pragma once
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+
+#include <string>
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+#include <unistd.h>
+#endif
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS) && defined(__linux__)
+#include <SocketServer/shmstream.h>
+#endif
+
+/**
+ * Transport policies for SocketConnection, SocketServer and SocketClient
+ *
+ * A transport picks the stream every connection reads and writes through, the protocol its
+ * acceptors and resolvers use, and whether a handshake has to happen before the first frame.
+ * TLS over TCP is the default, plain TCP and Unix domain sockets skip the encryption for peers
+ * that live on the same host or a trusted network. Shared memory goes one step further for
+ * peers on the same host and keeps the frames out of the kernel altogether.
+ */
+
+// Stands in for an ssl context on transports without TLS
+struct no_tls_context {};
+
+struct tls_transport {
+    typedef asio::ip::tcp protocol_type;
+    typedef protocol_type::endpoint endpoint_type;
+    typedef asio::ssl::context context_type;
+    typedef asio::ssl::stream<protocol_type::socket> stream_type;
+    typedef stream_type::lowest_layer_type socket_type;
+
+    // The stream is encrypted and needs a certificate, key and CA
+    static constexpr bool secure = true;
+    // Connections handshake before any frame is exchanged
+    static constexpr bool handshake = true;
+    // Several acceptors can share the endpoint through SO_REUSEPORT
+    static constexpr bool shardable = true;
+
+    static context_type make_context() {
+        return context_type(asio::ssl::context::sslv23);
+    }
+
+    template<typename Executor>
+    static stream_type make_stream(const Executor& executor, context_type& context) {
+        return stream_type(executor, context);
+    }
+
+    static void prepare_bind(const endpoint_type& endpoint) {}
+};
+
+struct tcp_transport {
+    typedef asio::ip::tcp protocol_type;
+    typedef protocol_type::endpoint endpoint_type;
+    typedef no_tls_context context_type;
+    typedef protocol_type::socket stream_type;
+    typedef stream_type::lowest_layer_type socket_type;
+
+    static constexpr bool secure = false;
+    static constexpr bool handshake = false;
+    static constexpr bool shardable = true;
+
+    static context_type make_context() {
+        return context_type();
+    }
+
+    template<typename Executor>
+    static stream_type make_stream(const Executor& executor, context_type& context) {
+        return stream_type(executor);
+    }
+
+    static void prepare_bind(const endpoint_type& endpoint) {}
+};
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+struct local_transport {
+    typedef asio::local::stream_protocol protocol_type;
+    typedef protocol_type::endpoint endpoint_type;
+    typedef no_tls_context context_type;
+    typedef protocol_type::socket stream_type;
+    typedef stream_type::lowest_layer_type socket_type;
+
+    static constexpr bool secure = false;
+    static constexpr bool handshake = false;
+    // The kernel doesn't balance Unix sockets between acceptors, only one may listen on a path
+    static constexpr bool shardable = false;
+
+    static context_type make_context() {
+        return context_type();
+    }
+
+    template<typename Executor>
+    static stream_type make_stream(const Executor& executor, context_type& context) {
+        return stream_type(executor);
+    }
+
+    // A socket file left behind by a previous run would make bind fail
+    static void prepare_bind(const endpoint_type& endpoint) {
+        ::unlink(endpoint.path().c_str());
+    }
+};
+#endif
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS) && defined(__linux__)
+// Connects over a Unix domain socket, then the handshake swaps it for shared memory rings
+struct shm_transport {
+    typedef asio::local::stream_protocol protocol_type;
+    typedef protocol_type::endpoint endpoint_type;
+    typedef no_tls_context context_type;
+    typedef shmstream stream_type;
+    typedef stream_type::lowest_layer_type socket_type;
+
+    static constexpr bool secure = false;
+    static constexpr bool handshake = true;
+    static constexpr bool shardable = false;
+
+    static context_type make_context() {
+        return context_type();
+    }
+
+    template<typename Executor>
+    static stream_type make_stream(const Executor& executor, context_type& context) {
+        return stream_type(executor);
+    }
+
+    static void prepare_bind(const endpoint_type& endpoint) {
+        ::unlink(endpoint.path().c_str());
+    }
+};
+#endif
@@ -0,0 +1,282 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct workerstats {
+    // Jobs waiting for the worker right now
+    size_t depth = 0;
+    uint64_t handled = 0;
+    // Jobs this worker took from another worker's queue
+    uint64_t stolen = 0;
+
+    // Time from pushing a job until a worker started it
+    uint64_t totalQueueNanos = 0;
+    uint64_t maxQueueNanos = 0;
+
+    double averageQueueMicros() const {
+        return this->handled > 0 ? (double)this->totalQueueNanos / (double)this->handled / 1000.0 : 0.0;
+    }
+};
+
+/**
+ * Keyed worker pool
+ *
+ * Jobs pushed with the same key always run on the same worker, one after the other in the order
+ * they were pushed, while jobs with different keys run in parallel. Jobs pushed as UNORDERED go to
+ * an idle worker if there is one, or else to the worker with the shortest queue, and a worker that
+ * runs out of work steals them from the back of the others' queues before it goes to sleep.
+ * Keyed jobs are never stolen. A push to a worker whose queue is at capacity waits until it has
+ * taken a job, so whoever feeds the pool slows down instead of queueing without end.
+ */
+template<typename Job>
+class workerpool {
+public:
+    // Key of a job that may run anywhere, in any order
+    static constexpr size_t UNORDERED = SIZE_MAX;
+
+    // Jobs a worker queues before pushes to it wait
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+    typedef workerstats stats;
+
+private:
+    struct entry {
+        Job job;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    struct worker {
+        std::deque<entry> ordered;
+        std::deque<entry> stealable;
+        std::mutex mux;
+        std::condition_variable cv;
+        // Pushes waiting for the queue to drop below capacity
+        std::condition_variable cvSpace;
+
+        // Set before the worker's last look for work, so a push either sees it or is seen
+        std::atomic<bool> bIdle { false };
+        // Set under mux when there is something to steal elsewhere
+        bool bWake = false;
+
+        std::atomic<size_t> nDepth { 0 };
+        std::atomic<uint64_t> nHandled { 0 };
+        std::atomic<uint64_t> nStolen { 0 };
+        std::atomic<uint64_t> nQueueNanos { 0 };
+        std::atomic<uint64_t> nMaxQueueNanos { 0 };
+
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::function<void(Job&)> handler;
+    size_t nCapacity;
+    std::atomic<bool> bStopping { false };
+
+public:
+    workerpool(size_t count, std::function<void(Job&)> handler, size_t capacity = DEFAULT_CAPACITY)
+        : handler(std::move(handler)), nCapacity(std::max<size_t>(capacity, 1))
+    {
+        count = std::max<size_t>(count, 1);
+        for (size_t i = 0; i < count; i++) {
+            this->workers.push_back(std::make_unique<worker>());
+        }
+        for (size_t i = 0; i < count; i++) {
+            this->workers[i]->thread = std::thread([this, i]() { this->run(i); });
+        }
+    }
+    workerpool(const workerpool&) = delete;
+    workerpool& operator=(const workerpool&) = delete;
+
+    ~workerpool() {
+        this->stop();
+    }
+
+public:
+    // Queues job behind every job pushed with the same key, does nothing once stopped
+    // Waits while the worker that gets the job is at capacity
+    void push(size_t key, Job&& job) {
+        if (this->bStopping.load(std::memory_order_relaxed)) {
+            return;
+        }
+
+        entry queued { std::move(job), std::chrono::steady_clock::now() };
+        if (key != UNORDERED) {
+            this->enqueue(*this->workers[workerpool::spread(key) % this->workers.size()], std::move(queued), false);
+            return;
+        }
+
+        worker* target = nullptr;
+        for (auto& w : this->workers) {
+            if (w->bIdle.load()) {
+                target = w.get();
+                break;
+            }
+            if (!target || w->nDepth.load(std::memory_order_relaxed) < target->nDepth.load(std::memory_order_relaxed)) {
+                target = w.get();
+            }
+        }
+        bool targetIdle = target->bIdle.load();
+        this->enqueue(*target, std::move(queued), true);
+
+        // A worker that went idle after we looked steals it from the back of target
+        if (!targetIdle) {
+            for (auto& w : this->workers) {
+                if (w.get() != target && w->bIdle.load()) {
+                    {
+                        std::scoped_lock lock(w->mux);
+                        w->bWake = true;
+                    }
+                    w->cv.notify_one();
+                    break;
+                }
+            }
+        }
+    }
+
+    // Finishes the jobs that are running, the queued ones are dropped along with those of waiting pushes
+    void stop() {
+        if (this->bStopping.exchange(true)) {
+            return;
+        }
+
+        for (auto& w : this->workers) {
+            {
+                std::scoped_lock lock(w->mux);
+            }
+            w->cv.notify_all();
+            w->cvSpace.notify_all();
+        }
+        for (auto& w : this->workers) {
+            if (w->thread.joinable()) {
+                w->thread.join();
+            }
+        }
+    }
+
+    size_t size() const {
+        return this->workers.size();
+    }
+
+    std::vector<stats> Stats() const {
+        std::vector<stats> all;
+        for (auto& w : this->workers) {
+            stats current;
+            current.depth = w->nDepth.load(std::memory_order_relaxed);
+            current.handled = w->nHandled.load(std::memory_order_relaxed);
+            current.stolen = w->nStolen.load(std::memory_order_relaxed);
+            current.totalQueueNanos = w->nQueueNanos.load(std::memory_order_relaxed);
+            current.maxQueueNanos = w->nMaxQueueNanos.load(std::memory_order_relaxed);
+            all.push_back(current);
+        }
+        return all;
+    }
+
+private:
+    // Keys are often pointers, whose low bits are all alike, so every bit gets a say in the worker
+    static size_t spread(size_t key) {
+        uint64_t mixed = key;
+        mixed ^= mixed >> 33;
+        mixed *= 0xff51afd7ed558ccdULL;
+        mixed ^= mixed >> 33;
+        return (size_t)mixed;
+    }
+
+    void enqueue(worker& w, entry&& queued, bool stealable) {
+        {
+            std::unique_lock lock(w.mux);
+            w.cvSpace.wait(lock, [&]() {
+                return this->bStopping.load() || w.ordered.size() + w.stealable.size() < this->nCapacity;
+            });
+            if (this->bStopping.load()) {
+                return;
+            }
+            (stealable ? w.stealable : w.ordered).push_back(std::move(queued));
+            w.nDepth.fetch_add(1, std::memory_order_relaxed);
+        }
+        w.cv.notify_one();
+    }
+
+    void run(size_t index) {
+        worker& self = *this->workers[index];
+        while (true) {
+            entry next;
+            if (!this->take(self, next) && !this->steal(self, next)) {
+                std::unique_lock lock(self.mux);
+                self.bIdle.store(true);
+                lock.unlock();
+
+                // Look once more now that pushes see us idle
+                if (!this->steal(self, next)) {
+                    lock.lock();
+                    self.cv.wait(lock, [&]() {
+                        return this->bStopping.load() || !self.ordered.empty() || !self.stealable.empty() || self.bWake;
+                    });
+                    self.bWake = false;
+                    self.bIdle.store(false);
+                    if (this->bStopping.load()) {
+                        return;
+                    }
+                    continue;
+                }
+                self.bIdle.store(false);
+            }
+
+            if (this->bStopping.load(std::memory_order_relaxed)) {
+                return;
+            }
+
+            uint64_t waited = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - next.queued).count();
+            self.nQueueNanos.fetch_add(waited, std::memory_order_relaxed);
+            uint64_t max = self.nMaxQueueNanos.load(std::memory_order_relaxed);
+            while (waited > max && !self.nMaxQueueNanos.compare_exchange_weak(max, waited, std::memory_order_relaxed)) {}
+
+            this->handler(next.job);
+            self.nHandled.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // The worker's own jobs come first, keyed ones before stealable ones
+    bool take(worker& self, entry& next) {
+        std::scoped_lock lock(self.mux);
+        std::deque<entry>& from = !self.ordered.empty() ? self.ordered : self.stealable;
+        if (from.empty()) {
+            return false;
+        }
+
+        next = std::move(from.front());
+        from.pop_front();
+        self.nDepth.fetch_sub(1, std::memory_order_relaxed);
+        self.cvSpace.notify_one();
+        return true;
+    }
+
+    // Takes the newest stealable job of another worker, the oldest ones are left to their owner
+    bool steal(worker& self, entry& next) {
+        for (auto& w : this->workers) {
+            if (w.get() == &self) {
+                continue;
+            }
+
+            std::scoped_lock lock(w->mux);
+            if (!w->stealable.empty()) {
+                next = std::move(w->stealable.back());
+                w->stealable.pop_back();
+                w->nDepth.fetch_sub(1, std::memory_order_relaxed);
+                w->cvSpace.notify_one();
+                self.nStolen.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+};
@@ -2,60 +2,254 @@
 #include <SocketServer/SocketServer.h>
 #include <SocketServer/SocketConnection.h>
 #include "config.h"
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <type_traits>
 #include <unordered_set>
 
-class ServerRelay: public SocketServer<MessageType> {
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Holds the local sockets, only the relay's user may write to it so nobody else can swap them out
+#ifndef RELAY_RUNTIME_DIR
+#define RELAY_RUNTIME_DIR "/run/server-relay"
+#endif
+
+// Local clients such as the web gateway skip TLS and connect through this socket
+#ifndef RELAY_SOCKET_PATH
+#define RELAY_SOCKET_PATH RELAY_RUNTIME_DIR "/relay.sock"
+#endif
+
+// Local consumers such as the renderer and the recorder take frames through shared memory
+#ifndef RELAY_SHM_PATH
+#define RELAY_SHM_PATH RELAY_RUNTIME_DIR "/relay-shm.sock"
+#endif
+
+// Creates the runtime directory, or checks that an existing one belongs to us and only we can write to it
+static bool PrepareRuntimeDirectory() {
+    if (::mkdir(RELAY_RUNTIME_DIR, 0750) != 0 && errno != EEXIST) {
+        LOG(ERROR, "Cannot create the runtime directory " RELAY_RUNTIME_DIR, strerror(errno));
+        return false;
+    }
+
+    struct stat status;
+    if (::lstat(RELAY_RUNTIME_DIR, &status) != 0 || !S_ISDIR(status.st_mode) || status.st_uid != ::geteuid() || (status.st_mode & (S_IWGRP | S_IWOTH))) {
+        LOG(ERROR, "The runtime directory must be ours and not writable by anyone else", RELAY_RUNTIME_DIR);
+        return false;
+    }
+    return true;
+}
+
+// Local peers are let in if they run as our user, our group or root, the same people who could read our certificates
+static bool PeerAllowed(int fd) {
+#if defined(__linux__)
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+        return false;
+    }
+    uid_t uid = credentials.uid;
+    gid_t gid = credentials.gid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (::getpeereid(fd, &uid, &gid) != 0) {
+        return false;
+    }
+#endif
+    return uid == 0 || uid == ::geteuid() || gid == ::getegid();
+}
+
+template<typename Transport>
+class ServerRelay: public SocketServer<MessageType, Transport> {
 public:
-    ServerRelay(uint16_t port, std::string certPath, std::string keyPath, std::string caPath): SocketServer(port, certPath, keyPath, caPath) {};
+    using SocketServer<MessageType, Transport>::SocketServer;
+
+    // Messages relayed to our clients are relayed to the clients of other as well
+    template<typename OtherTransport>
+    void RelayTo(ServerRelay<OtherTransport>& other) {
+        this->relays.push_back([&other](const Message<MessageType>& msg) { other.MessageSubscribers(msg); });
+        this->routes.push_back([&other](const Message<MessageType>& msg, const std::vector<uint64_t>& targets) { other.MessageDevices(targets, msg); });
+    }
+
+    // Pings and relayed commands are handled on the io thread that read them, without the trip through the request thread
+    // OnMessageRecieved still handles them for a relay that doesn't call this
+    void HandleInline() {
+        this->SetInlineHandler(ServerPing, [](std::shared_ptr<SocketConnection<MessageType, Transport> > client, Message<MessageType>& msg) {
+            // Simply bounce back the message
+            client->Send(msg);
+        });
+
+        for (MessageType id : { CubeDisplayOnOff, CubeBrightness, CubePulse, CubeRehoboam, ServerShutdown, SetSolidColor, CubeChristmas }) {
+            this->SetInlineHandler(id, [this](std::shared_ptr<SocketConnection<MessageType, Transport> > client, Message<MessageType>& msg) {
+                this->Relay(msg, client);
+            });
+        }
+    }
 
 protected:
-    bool OnClientConnect(std::shared_ptr<SocketConnection<MessageType> > client) override {
-        std::string ip = client->socket().remote_endpoint().address().to_string();
-        if (whitelist.find(ip) != whitelist.end()) {
+    bool OnClientConnect(std::shared_ptr<SocketConnection<MessageType, Transport> > client) override {
+        // The socket file is only open to our user and group, the peer's credentials are checked as well
+        // in case it was connected before the permissions were tightened
+        if constexpr (std::is_same<typename Transport::protocol_type, asio::local::stream_protocol>::value) {
+            if (!PeerAllowed(client->socket().native_handle())) {
+                LOG(ERROR, "Local peer isn't our user or group -- refusing it");
+                return false;
+            }
             return true;
+        } else {
+            std::string ip = client->socket().remote_endpoint().address().to_string();
+            if (whitelist.find(ip) != whitelist.end()) {
+                return true;
+            }
+            return false;
         }
-        return false; 
     }
-    void OnMessageRecieved(std::shared_ptr<SocketConnection<MessageType> > client, Message<MessageType>& msg) override {
+    void OnMessageRecieved(std::shared_ptr<SocketConnection<MessageType, Transport> > client, Message<MessageType>& msg) override {
         switch (msg.header.id) {
             case ServerPing:
                 // Simply bounce back the message
                 client->Send(msg);
                 break;
             case CubeDisplayOnOff:
-                this->MessageAllClients(msg, client);
+                this->Relay(msg, client);
                 break;
             case CubeBrightness:
-                this->MessageAllClients(msg, client);
+                this->Relay(msg, client);
                 break;
             case CubePulse:
-                this->MessageAllClients(msg, client);
+                this->Relay(msg, client);
                 break;
             case CubeRehoboam:
-                this->MessageAllClients(msg, client);
+                this->Relay(msg, client);
                 break;
             case ServerShutdown:
-                this->MessageAllClients(msg, client);
+                this->Relay(msg, client);
                 break;
             case SetSolidColor:
-                this->MessageAllClients(msg, client);
+                this->Relay(msg, client);
                 break;
             case CubeChristmas:
-                this->MessageAllClients(msg, client);
+                this->Relay(msg, client);
+                break;
+            case ServerSubscribe:
+            case ServerUnsubscribe:
+            case ServerSubscribeCategory:
+            case ServerUnsubscribeCategory:
+                this->UpdateSubscriptions(msg, client);
                 break;
             case Success:
                 break;
         }
     }
+
+    // Addressed messages only reach their targets, on whichever server they are connected
+    void OnAddressedMessageRecieved(std::shared_ptr<SocketConnection<MessageType, Transport> > client, Message<MessageType>& msg, const std::vector<uint64_t>& targets) override {
+        this->MessageDevices(targets, msg);
+        for (auto& route : this->routes) {
+            route(msg, targets);
+        }
+    }
+
+private:
+    void Relay(const Message<MessageType>& msg, std::shared_ptr<SocketConnection<MessageType, Transport> > client) {
+        this->MessageSubscribers(msg, client);
+        for (auto& relay : this->relays) {
+            relay(msg);
+        }
+    }
+
+    void UpdateSubscriptions(Message<MessageType>& msg, std::shared_ptr<SocketConnection<MessageType, Transport> > client) {
+        while (msg.size() >= sizeof(uint32_t)) {
+            uint32_t topic;
+            msg >> topic;
+            switch (msg.header.id) {
+                case ServerSubscribe:
+                    this->Subscribe(client, (MessageType)topic);
+                    break;
+                case ServerUnsubscribe:
+                    this->Unsubscribe(client, (MessageType)topic);
+                    break;
+                case ServerSubscribeCategory:
+                    this->SubscribeCategory(client, topic);
+                    break;
+                default:
+                    this->UnsubscribeCategory(client, topic);
+                    break;
+            }
+        }
+    }
+
+    std::vector<std::function<void(const Message<MessageType>&)>> relays;
+    std::vector<std::function<void(const Message<MessageType>&, const std::vector<uint64_t>&)>> routes;
 };
 
 int main(void) {
-    ServerRelay server(port, certPath, keyPath, caPath);
+    if (!PrepareRuntimeDirectory()) {
+        return 1;
+    }
+
+    ServerRelay<tls_transport> server(port, certPath, keyPath, caPath, std::thread::hardware_concurrency());
+    ServerRelay<local_transport> localServer(local_transport::endpoint_type(RELAY_SOCKET_PATH));
+    ServerRelay<shm_transport> shmServer(shm_transport::endpoint_type(RELAY_SHM_PATH));
+    server.RelayTo(localServer);
+    server.RelayTo(shmServer);
+    localServer.RelayTo(server);
+    localServer.RelayTo(shmServer);
+    shmServer.RelayTo(server);
+    shmServer.RelayTo(localServer);
+
+    // Web controllers subscribe to what they display instead of receiving every cube command
+    std::vector<MessageType> cubeCommands = { CubeDisplayOnOff, CubeBrightness, CubePulse, CubeRehoboam, SetSolidColor, CubeChristmas };
+    std::vector<MessageType> serverCommands = { ServerPing, ServerShutdown };
+    server.DefineCategory(CubeCommands, cubeCommands);
+    server.DefineCategory(ServerCommands, serverCommands);
+    localServer.DefineCategory(CubeCommands, cubeCommands);
+    localServer.DefineCategory(ServerCommands, serverCommands);
+    shmServer.DefineCategory(CubeCommands, cubeCommands);
+    shmServer.DefineCategory(ServerCommands, serverCommands);
+
+    // A cube that can't keep up is dropped and reconnects instead of growing the relay's memory
+    OutboundLimits limits;
+    limits.highWatermarkBytes = 4 * 1024 * 1024;
+    limits.lowWatermarkBytes = 1024 * 1024;
+    limits.highWatermarkMessages = 16384;
+    limits.lowWatermarkMessages = 4096;
+    limits.policy = SlowConsumerPolicy::disconnect;
+    server.SetOutboundLimits(limits);
+    localServer.SetOutboundLimits(limits);
+    shmServer.SetOutboundLimits(limits);
+
+    // Stop reading from cubes rather than queueing more than this in total
+    server.SetMemoryBudget(256 * 1024 * 1024, 8 * 1024 * 1024);
+    localServer.SetMemoryBudget(64 * 1024 * 1024, 8 * 1024 * 1024);
+    shmServer.SetMemoryBudget(64 * 1024 * 1024, 8 * 1024 * 1024);
+
+    // When the relay restarts the whole fleet reconnects at once, keep those handshakes off the io threads
+    server.SetHandshakePool(2, 64);
+
+    // A cube whose messages are slow to relay only holds up its own messages, not the whole fleet
+    server.SetRequestWorkers(4);
+
+    server.HandleInline();
+    localServer.HandleInline();
+    shmServer.HandleInline();
+
     server.Start();
+    localServer.Start();
+    shmServer.Start();
+
+    // The sockets are created with the umask, relayed commands include ServerShutdown
+    ::chmod(RELAY_SOCKET_PATH, 0660);
+    ::chmod(RELAY_SHM_PATH, 0660);
 
+    localServer.HandleRequests();
+    shmServer.HandleRequests();
     while (true) {
         server.HandleRequestsNoThread();
     }
 
     return 0;
-}
\ No newline at end of file
+}